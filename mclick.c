@@ -10,10 +10,36 @@
 #include <ctime>
 #include <iomanip>
 #include <map>
-#include <unordered_map>
 #include <stdexcept>
 #include <random>
+#include <cmath>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <sstream>
+#include <algorithm>
+#include <bitset>
+#include <queue>
+#include <csignal>
 #include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <dirent.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <linux/io_uring.h>
 
 using namespace std;
 
@@ -21,247 +47,4241 @@ using namespace std;
 const int DEFAULT_HOLD_MS = 120;     // -h: press duration
 const int DEFAULT_CLICK_SPEED_MS = 120; // -cs: between clicks
 const int DEFAULT_CLICK_COUNT = 1;    // Default clicks
+const char* DEFAULT_SOCKET_PATH = "/tmp/mclick.sock"; // --daemon control socket
+const size_t MAX_REQUEST_SIZE = 4096;  // Longest accepted daemon request line
+const int MAX_FRAME_EVENTS = 16;      // Events per SYN_REPORT frame, including the SYN
+const int MAX_EDGE_EVENTS = 4;        // One click edge: REL_X, REL_Y, REL_WHEEL, the button
+const size_t LOG_RING_SIZE = 4096;    // Debug records buffered per thread, power of two
+const int LOG_FLUSH_INTERVAL_MS = 20; // How often the log thread drains the rings
+const int64_t NS_PER_US = 1000;
+const int64_t NS_PER_MS = 1000000;
+const int64_t NS_PER_SEC = 1000000000;
+const int64_t SPIN_WINDOW_NS = 200 * NS_PER_US;              // Spin this long before a deadline
+const int64_t HIGH_FREQUENCY_THRESHOLD_NS = 2 * NS_PER_MS;   // Shorter -h/-cs imply -hf
+const int64_t EFFICIENT_WINDOW_NS = 25 * NS_PER_MS;  // --efficient timer slack and wakeup grid
+const double DEFAULT_DUTY = 0.5;  // Share of a --cps period the button is held
+const int64_t MAX_WAKE_LEAD_NS = NS_PER_MS;  // Cap on the --cps wakeup correction
+const int64_t DEFAULT_READY_TIMEOUT_NS = 500 * NS_PER_MS;    // Max wait for a reader on the new node
+const int DEFAULT_RT_PRIORITY = 50;   // --realtime SCHED_FIFO priority
+const size_t RECORD_READ_EVENTS = 256;      // input_events per read() while recording
+const size_t RECORD_CHUNK_RECORDS = 65536;  // Records handed to the writer thread at once
+const uint64_t MAX_MACRO_RECORDS = 1ULL << 28;  // 4GiB of timeline from one macro
+const int MAX_MACRO_DEPTH = 64;                 // Nested repeat blocks
+const uint32_t MACRO_COMPILER_VERSION = 1;      // Part of the cache key
+const int MAX_COUNTER_THREADS = 64;   // Threads that can own a stats slot
+const int LATENESS_BUCKETS = 16;      // Power-of-two buckets, 1us up to 16ms plus +Inf
+const int BURST_CHUNK_CLICKS = 4096;  // Clicks per --burst buffer, 384KiB
+const int64_t CONTROL_POLL_NS = NS_PER_MS;  // Pause re-check interval for --shm
+const int JITTER_TABLE_BITS = 10;     // 1024 precomputed offsets, 8KiB per stream
+const size_t STDIN_BUFFER_SIZE = 64 * 1024;  // --stdin read size, also the longest line
+const int MAX_STDIN_TOKENS = 64;
+const int MAX_POOL_DEVICES = 64;
+const size_t DEVICE_QUEUE_SIZE = 1024;  // Commands and finished tags in flight per pool device
+const int64_t PROBE_TIMEOUT_NS = 100 * NS_PER_MS;  // A frame not read back by then counts as lost
+const unsigned URING_WINDOW = 64;     // Frames queued in the kernel ahead of time
 
-// ANSI Colors
-const string COLOR_RESET = "\033[0m";
-const string COLOR_RED = "\033[31m";
-const string COLOR_GREEN = "\033[32m";
-const string COLOR_YELLOW = "\033[33m";
-const string COLOR_BLUE = "\033[34m";
+// ANSI Colors, plain literals so nothing is constructed at startup
+constexpr const char* COLOR_RESET = "\033[0m";
+constexpr const char* COLOR_RED = "\033[31m";
+constexpr const char* COLOR_GREEN = "\033[32m";
+constexpr const char* COLOR_YELLOW = "\033[33m";
+constexpr const char* COLOR_BLUE = "\033[34m";
 
 // Global state with thread safety
 atomic<bool> debug_mode{false};
-atomic<int> click_speed_ms{DEFAULT_CLICK_SPEED_MS};
+atomic<bool> stop_requested{false};  // Set by SIGINT/SIGTERM
+volatile sig_atomic_t stop_signal = 0;  // Which one, for the exit status
+int stop_event_fd = -1;              // Readable once a stop signal came, for poll loops
+bool print_stats_at_exit = false;    // --stats
 
-int setup_uinput_device() {
-    int fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+inline bool stopping() {
+    return stop_requested.load(memory_order_relaxed);
+}
+
+// poll() on one descriptor and stop_event_fd, so a stop signal ends the
+// wait even when it lands just before the call. Returns 0 when only the
+// stop fired; callers check stopping() in their loop condition.
+int poll_or_stop(int fd, short events, int timeout_ms) {
+    struct pollfd fds[2] = {{fd, events, 0}, {stop_event_fd, POLLIN, 0}};
+    int ready = poll(fds, stop_event_fd >= 0 ? 2 : 1, timeout_ms);
+    return ready > 0 && !fds[0].revents ? 0 : ready;
+}
+
+// --timestamps: what goes into input_event.time. uinput ignores it and
+// the input core stamps every event itself, so by default mclick leaves
+// it zeroed and reads no clock for it at all.
+enum TimestampMode { TIMESTAMP_KERNEL, TIMESTAMP_MONOTONIC, TIMESTAMP_REALTIME };
+TimestampMode timestamp_mode = TIMESTAMP_KERNEL;
+int64_t ready_timeout_ns = DEFAULT_READY_TIMEOUT_NS;
+
+// Timeline files: a fixed header followed by packed records, laid out so
+// the file can be mmapped and streamed in place. Records at the same
+// instant (delta 0) up to an EV_SYN/SYN_REPORT record form one frame.
+const char TIMELINE_MAGIC[8] = {'M', 'C', 'L', 'K', 'T', 'L', '\0', '\1'};
+const uint32_t TIMELINE_VERSION = 1;
+
+struct TimelineHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;   // sizeof(TimelineRecord), checked on load
+    uint64_t record_count;
+    uint64_t duration_ns;   // Sum of all deltas
+};
+
+struct TimelineRecord {
+    uint64_t delta_ns;      // Since the previous record
+    uint16_t type;
+    uint16_t code;
+    int32_t value;
+};
+
+static_assert(sizeof(TimelineHeader) == 32, "TimelineHeader must stay packed");
+static_assert(sizeof(TimelineRecord) == 16, "TimelineRecord must stay packed");
+
+// --realtime: applied to the clicking thread right before it starts
+struct RealtimeProfile {
+    bool enabled = false;
+    int priority = DEFAULT_RT_PRIORITY;
+    int cpu = -1;  // -1 leaves the affinity alone
+};
+
+RealtimeProfile realtime_profile;
+
+// --efficient: the opposite trade for slow clickers on battery. Wide
+// timer slack, no spinning, and scheduler wakeups aligned to a shared
+// EFFICIENT_WINDOW_NS grid so streams wake together.
+bool efficient_mode = false;
+
+// Buttons by command-line letter; all of them and the relative axes are
+// enabled on the virtual device
+struct ButtonName {
+    char name;
+    int code;
+};
+const ButtonName BUTTONS[] = {
+    {'l', BTN_LEFT}, {'r', BTN_RIGHT}, {'m', BTN_MIDDLE}, {'s', BTN_SIDE},
+    {'e', BTN_EXTRA}, {'f', BTN_FORWARD}, {'b', BTN_BACK},
+};
+const int REL_AXES[] = {REL_X, REL_Y, REL_WHEEL, REL_HWHEEL};
+
+// Shared-memory control block for --shm. Writers are `mclick ctl` or any
+// tool that maps /dev/shm/<name>; the click loop reads the fields with
+// relaxed loads once per cycle, so retuning costs no syscall on either
+// side. Layout is fixed: magic, then 8-byte lock-free atomics.
+const char CONTROL_MAGIC[8] = {'M', 'C', 'L', 'K', 'C', 'T', 'L', '\1'};
+
+struct ControlBlock {
+    char magic[8];
+    int64_t pid;
+    atomic<int64_t> hold_ns;
+    atomic<int64_t> click_speed_ns;
+    atomic<uint64_t> paused;      // Non-zero: wait between clicks, button up
+    atomic<uint64_t> stop;        // Non-zero: end the run after the current click
+    atomic<uint64_t> clicks;      // Live counters, written by the click loop
+    atomic<int64_t> started_ns;   // CLOCK_MONOTONIC
+    atomic<int64_t> last_click_ns;
+};
+static_assert(atomic<int64_t>::is_always_lock_free, "ControlBlock needs lock-free 64-bit atomics");
+
+ControlBlock* control_block = nullptr;  // Mapped by --shm
+
+enum JitterDist { JITTER_UNIFORM, JITTER_NORMAL, JITTER_LOGNORMAL };
+
+// Relative motion sent in the same frame as a click's press or release
+struct PointerMotion {
+    int move_x = 0, move_y = 0;  // --move: before the press, in its frame
+    int drag_x = 0, drag_y = 0;  // --drag: while held, in the release frame
+    int wheel = 0;               // --wheel: detents in the press frame
+};
+
+// One click request, parsed from argv or from a daemon request line
+struct ClickJob {
+    int button = BTN_LEFT;
+    int count = DEFAULT_CLICK_COUNT;
+    int64_t hold_ns = DEFAULT_HOLD_MS * NS_PER_MS;
+    int64_t click_speed_ns = DEFAULT_CLICK_SPEED_MS * NS_PER_MS;
+    int64_t duration_ns = 0;
+    bool high_frequency = false;
+    double target_cps = 0;  // Set by --cps, which derives hold and speed
+    int burst = 0;          // --burst: clicks written back to back, no timing
+    int64_t jitter_ns = 0;  // --jitter bound on every deadline's offset
+    JitterDist jitter_dist = JITTER_NORMAL;
+    PointerMotion motion;
+};
+
+// Everything one invocation or daemon request asks for: several streams
+// run side by side, e.g. "l -cs 50ms r -cs 300ms"
+struct ClickRequest {
+    vector<ClickJob> streams;
+    bool debug = false;
+    string hotkey_node;   // --hotkey: evdev node to watch
+    int hotkey = -1;      // Key code that starts and stops the streams
+    bool toggle = false;  // --toggle: press to start, press again to stop
+    string shm_name;      // --shm: control block to expose
+    int device = -1;      // --device: daemon pool device, -1 for the least busy
+};
+
+// Humanizing offsets for --jitter. The distribution is sampled once into
+// a table, re-centred to zero mean and clamped to the bound, so a click
+// costs one xorshift step and a load. Offsets move single deadlines
+// around the absolute grid and never accumulate, so the mean rate stays
+// exactly the grid's.
+class Jitter {
+public:
+    Jitter() = default;
+
+    explicit Jitter(const ClickJob& job) {
+        if (job.jitter_ns <= 0) return;  // No table, no seed: reading random_device costs a syscall
+
+        state = random_device()() | 1ULL;
+        mt19937_64 generator(state);
+        normal_distribution<double> normal(0.0, 1.0);
+        uniform_real_distribution<double> uniform(-1.0, 1.0);
+        vector<double> samples(1 << JITTER_TABLE_BITS);
+        for (double& sample : samples) {
+            if (job.jitter_dist == JITTER_UNIFORM) {
+                sample = uniform(generator);
+            } else if (job.jitter_dist == JITTER_NORMAL) {
+                sample = normal(generator) / 3;  // 3 sigma at the bound
+            } else {
+                sample = exp(normal(generator) * 0.5);
+            }
+        }
+
+        // Centre, then scale the widest sample onto the bound
+        double mean = 0, widest = 0;
+        for (double sample : samples) mean += sample / samples.size();
+        for (double& sample : samples) widest = max(widest, fabs(sample -= mean));
+        const double scale = job.jitter_dist == JITTER_LOGNORMAL ? job.jitter_ns / widest : job.jitter_ns;
+        for (double sample : samples) {
+            int64_t offset = llround(sample * scale);
+            table.push_back(max(-job.jitter_ns, min(job.jitter_ns, offset)));
+        }
+    }
+
+    int64_t next() {
+        if (table.empty()) return 0;
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return table[(state * 0x2545F4914F6CDD1DULL) >> (64 - JITTER_TABLE_BITS)];
+    }
+
+private:
+    vector<int64_t> table;
+    uint64_t state = 1;
+};
+
+int64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+string format_duration(int64_t ns) {
+    if (ns % NS_PER_SEC == 0) return to_string(ns / NS_PER_SEC) + "s";
+    if (ns % NS_PER_MS == 0) return to_string(ns / NS_PER_MS) + "ms";
+    if (ns % NS_PER_US == 0) return to_string(ns / NS_PER_US) + "us";
+    return to_string(ns) + "ns";
+}
+
+// Resolves /dev/input/eventN for the device behind a uinput fd
+string get_event_node(int fd) {
+    char sysname[64] = {0};
+    if (ioctl(fd, UI_GET_SYSNAME(sizeof(sysname)), sysname) < 0) return "";
+
+    string sys_dir = string("/sys/devices/virtual/input/") + sysname;
+    DIR* dir = opendir(sys_dir.c_str());
+    if (!dir) return "";
+
+    string node;
+    while (struct dirent* entry = readdir(dir)) {
+        if (strncmp(entry->d_name, "event", 5) == 0) {
+            node = string("/dev/input/") + entry->d_name;
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+// True if any process already holds the node open
+bool node_opened_elsewhere(const string& node) {
+    DIR* proc = opendir("/proc");
+    if (!proc) return false;
+
+    bool found = false;
+    char link[PATH_MAX];
+    while (!found) {
+        struct dirent* pid = readdir(proc);
+        if (!pid) break;
+        if (!isdigit(pid->d_name[0])) continue;
+
+        string fd_dir = string("/proc/") + pid->d_name + "/fd";
+        DIR* fds = opendir(fd_dir.c_str());
+        if (!fds) continue;
+        while (struct dirent* entry = readdir(fds)) {
+            string path = fd_dir + "/" + entry->d_name;
+            ssize_t len = readlink(path.c_str(), link, sizeof(link) - 1);
+            if (len > 0 && node.compare(0, string::npos, link, len) == 0) {
+                found = true;
+                break;
+            }
+        }
+        closedir(fds);
+    }
+    closedir(proc);
+    return found;
+}
+
+// Events written before libinput/the compositor opens the new node are
+// lost, so wait until someone opens it. Watches /dev/input for the node
+// and the node itself for IN_OPEN, bounded by ready_timeout_ns.
+bool wait_device_ready(int fd) {
+    if (ready_timeout_ns == 0) return false;  // --ready-timeout 0
+    const int64_t start = monotonic_ns();
+    string node = get_event_node(fd);
+    if (node.empty()) {
+        if (debug_mode) {
+            cout << COLOR_YELLOW << "[DEBUG] Event node unknown, skipping readiness wait" << COLOR_RESET << endl;
+        }
+        return false;
+    }
+
+    int ino = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (ino < 0) return false;
+    inotify_add_watch(ino, "/dev/input", IN_CREATE);
+
+    bool ready = false;
+    bool watching_node = false;
+    for (;;) {
+        if (!watching_node && inotify_add_watch(ino, node.c_str(), IN_OPEN) >= 0) {
+            watching_node = true;
+            // An open that happened before the watch would go unnoticed
+            if (node_opened_elsewhere(node)) {
+                ready = true;
+                break;
+            }
+        }
+
+        int64_t remaining_ms = (start + ready_timeout_ns - monotonic_ns()) / NS_PER_MS;
+        if (remaining_ms <= 0) break;
+
+        int ready_fds = poll_or_stop(ino, POLLIN, remaining_ms);
+        if (stopping()) break;
+        if (ready_fds <= 0) continue;
+
+        alignas(struct inotify_event) char buffer[4096];
+        ssize_t len = read(ino, buffer, sizeof(buffer));
+        for (ssize_t offset = 0; offset < len;) {
+            const struct inotify_event* event = (const struct inotify_event*)(buffer + offset);
+            if (event->mask & IN_OPEN) ready = true;
+            offset += sizeof(struct inotify_event) + event->len;
+        }
+        if (ready) break;
+    }
+    close(ino);
+
+    if (debug_mode) {
+        cout << COLOR_YELLOW << "[DEBUG] " << node << (ready ? " opened after " : " not opened after ")
+             << format_duration((monotonic_ns() - start) / NS_PER_US * NS_PER_US) << COLOR_RESET << endl;
+    }
+    return ready;
+}
+
+// Creates the virtual mouse. Pool devices past the first get their own
+// name and product ID, so libinput and the compositor treat each as a
+// separate pointer. Throws on failure, never leaving a half-made device.
+// Callers whose first events may go unseen skip the readiness wait.
+int setup_uinput_device(int index = 0, bool wait_ready = true) {
+    const int64_t opened_at = monotonic_ns();
+    int fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK | O_CLOEXEC);
     if (fd < 0) {
+        throw runtime_error(string("Failed to open uinput device: ") + strerror(errno) +
+                            (errno == EACCES ? ", try running with sudo" : ""));
+    }
+    auto fail = [fd](const char* what) {
+        string reason = string(what) + ": " + strerror(errno);
+        close(fd);
+        throw runtime_error(reason);
+    };
+
+    bool capable = ioctl(fd, UI_SET_EVBIT, EV_KEY) >= 0 && ioctl(fd, UI_SET_EVBIT, EV_REL) >= 0;
+    for (const ButtonName& button : BUTTONS) capable = capable && ioctl(fd, UI_SET_KEYBIT, button.code) >= 0;
+    for (int axis : REL_AXES) capable = capable && ioctl(fd, UI_SET_RELBIT, axis) >= 0;
+    if (!capable) fail("Failed to set device capabilities");
+
+    struct uinput_setup setup;
+    memset(&setup, 0, sizeof(setup));
+    if (index == 0) {
+        snprintf(setup.name, UINPUT_MAX_NAME_SIZE, "virtual-mouse");
+    } else {
+        snprintf(setup.name, UINPUT_MAX_NAME_SIZE, "virtual-mouse-%d", index);
+    }
+    setup.id.bustype = BUS_USB;
+    setup.id.vendor = 0x1234;
+    setup.id.product = 0x5678 + index;
+    setup.id.version = 1;
+
+    // UI_DEV_SETUP needs Linux 4.5, older kernels only take the legacy
+    // uinput_user_dev write. The device has no absolute axes, so there is
+    // nothing for UI_ABS_SETUP either way.
+    const char* api = "UI_DEV_SETUP";
+    if (ioctl(fd, UI_DEV_SETUP, &setup) < 0) {
+        if (errno != EINVAL && errno != ENOTTY) fail("Failed to set up device");
+        struct uinput_user_dev dev;
+        memset(&dev, 0, sizeof(dev));
+        memcpy(dev.name, setup.name, sizeof(dev.name));
+        dev.id = setup.id;
+        if (write(fd, &dev, sizeof(dev)) != sizeof(dev)) fail("Failed to write device info");
+        api = "uinput_user_dev";
+    }
+
+    if (ioctl(fd, UI_DEV_CREATE) < 0) fail("Failed to create device");
+    if (debug_mode) {
+        cout << COLOR_YELLOW << "[DEBUG] " << setup.name << " created in "
+             << (monotonic_ns() - opened_at) / NS_PER_US << "us via " << api << COLOR_RESET << endl;
+    }
+
+    if (wait_ready) wait_device_ready(fd);
+    return fd;
+}
+
+// Unregisters the device before closing the descriptor, so readers see
+// it unplugged at once
+void destroy_uinput_device(int fd) {
+    const int64_t started = monotonic_ns();
+    if (ioctl(fd, UI_DEV_DESTROY) < 0 && debug_mode) {
+        cerr << COLOR_YELLOW << "[DEBUG] Failed to destroy device: " << strerror(errno) << COLOR_RESET << endl;
+    }
+    close(fd);
+    if (debug_mode) {
+        cout << COLOR_YELLOW << "[DEBUG] Device destroyed in " << (monotonic_ns() - started) / NS_PER_US
+             << "us" << COLOR_RESET << endl;
+    }
+}
+
+// Owns one virtual device for a scope, so it is destroyed on every way
+// out, exceptions included
+class UinputDevice {
+public:
+    explicit UinputDevice(int index = 0, bool wait_ready = true) : fd(setup_uinput_device(index, wait_ready)) {}
+    ~UinputDevice() { destroy_uinput_device(fd); }
+    UinputDevice(const UinputDevice&) = delete;
+    UinputDevice& operator=(const UinputDevice&) = delete;
+
+    const int fd;
+};
+
+// Closes a descriptor when the scope ends; negative means none
+struct ScopedFd {
+    explicit ScopedFd(int fd) : fd(fd) {}
+    ~ScopedFd() {
+        if (fd >= 0) close(fd);
+    }
+    ScopedFd(const ScopedFd&) = delete;
+    ScopedFd& operator=(const ScopedFd&) = delete;
+
+    const int fd;
+};
+
+// All events that belong to one instant. The frame is terminated with
+// SYN_REPORT and submitted with a single write, so the kernel never sees
+// a half-written frame.
+struct EventFrame {
+    struct input_event events[MAX_FRAME_EVENTS];
+    int count = 0;
+    int64_t deadline_ns = 0;  // Scheduled CLOCK_MONOTONIC time, for debug output
+
+    void add(uint16_t type, uint16_t code, int32_t value) {
+        if (count >= MAX_FRAME_EVENTS - 1) throw length_error("Event frame is full");
+        struct input_event& ie = events[count++];
+        memset(&ie, 0, sizeof(ie));
+        ie.type = type;
+        ie.code = code;
+        ie.value = value;
+    }
+
+    // The button edge, which follows any --move or --wheel events; null
+    // for frames without one
+    const struct input_event* key_edge() const {
+        for (int i = 0; i < count; i++) {
+            if (events[i].type == EV_KEY) return &events[i];
+        }
+        return nullptr;
+    }
+};
+
+// Debug output is formatted off the hot path: send_frame only copies a
+// LogRecord into a per-thread single-producer ring, and a background
+// thread drains all rings in batches.
+struct LogRecord {
+    int64_t timestamp_ns;  // CLOCK_MONOTONIC when the frame was submitted
+    int64_t deadline_ns;   // When the scheduler wanted it, 0 if unscheduled
+    uint16_t type;
+    uint16_t code;
+    int32_t value;
+};
+
+struct LogRing {
+    LogRecord records[LOG_RING_SIZE];
+    alignas(64) atomic<size_t> head{0};  // Next slot the producer writes
+    alignas(64) atomic<size_t> tail{0};  // Next slot the consumer reads
+    atomic<uint64_t> dropped{0};
+
+    void push(const LogRecord& record) {
+        size_t h = head.load(memory_order_relaxed);
+        if (h - tail.load(memory_order_acquire) == LOG_RING_SIZE) {
+            dropped.fetch_add(1, memory_order_relaxed);
+            return;
+        }
+        records[h & (LOG_RING_SIZE - 1)] = record;
+        head.store(h + 1, memory_order_release);
+    }
+};
+
+// Bounded single-producer single-consumer queue on the LogRing scheme,
+// for any copyable T. Both sides fail instead of blocking.
+template <typename T, size_t Size>
+struct SpscQueue {
+    static_assert((Size & (Size - 1)) == 0, "Size must be a power of two");
+    T slots[Size];
+    alignas(64) atomic<size_t> head{0};
+    alignas(64) atomic<size_t> tail{0};
+
+    bool push(const T& value) {
+        size_t h = head.load(memory_order_relaxed);
+        if (h - tail.load(memory_order_acquire) == Size) return false;
+        slots[h & (Size - 1)] = value;
+        head.store(h + 1, memory_order_release);
+        return true;
+    }
+
+    bool pop(T& value) {
+        size_t t = tail.load(memory_order_relaxed);
+        if (t == head.load(memory_order_acquire)) return false;
+        value = slots[t & (Size - 1)];
+        tail.store(t + 1, memory_order_release);
+        return true;
+    }
+};
+
+void handle_stop_signal(int sig) {
+    stop_signal = sig;
+    stop_requested.store(true, memory_order_relaxed);
+    if (stop_event_fd >= 0) {
+        int saved_errno = errno;
+        uint64_t one = 1;
+        if (write(stop_event_fd, &one, sizeof(one)) < 0) {}
+        errno = saved_errno;
+    }
+}
+
+// Installed without SA_RESTART, so the signal interrupts clock_nanosleep
+// on the click thread and the loops see stop_requested right away. A
+// signal landing just before epoll_wait is not lost either: the handler
+// also makes stop_event_fd readable.
+void install_stop_handler() {
+    if (stop_event_fd < 0) stop_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_stop_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+}
+
+// Helper threads never take SIGINT/SIGTERM, so the signals always land in
+// the thread doing the real work and interrupt its blocking call.
+template <typename Body>
+thread spawn_helper_thread(Body&& body) {
+    sigset_t blocked, previous;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    sigaddset(&blocked, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+    thread worker(forward<Body>(body));
+    pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+    return worker;
+}
+
+struct AsyncLog {
+    mutex rings_mutex;  // Guards registration only, never taken per record
+    vector<unique_ptr<LogRing>> rings;
+    thread worker;
+    atomic<bool> running{false};
+    int64_t realtime_offset_ns = 0;  // CLOCK_REALTIME - CLOCK_MONOTONIC
+};
+
+AsyncLog async_log;
+
+LogRing& local_log_ring() {
+    thread_local LogRing* ring = nullptr;
+    if (!ring) {
+        lock_guard<mutex> lock(async_log.rings_mutex);
+        async_log.rings.push_back(make_unique<LogRing>());
+        ring = async_log.rings.back().get();
+    }
+    return *ring;
+}
+
+void format_record(ostream& out, const LogRecord& record) {
+    int64_t wall_ns = record.timestamp_ns + async_log.realtime_offset_ns;
+    time_t time_point = wall_ns / NS_PER_SEC;
+    
+    out << COLOR_YELLOW << "[DEBUG] " << COLOR_GREEN
+        << put_time(localtime(&time_point), "%H:%M:%S:") << (wall_ns % NS_PER_SEC) / NS_PER_MS
+        << " " << (record.value ? "Press" : "Release") << " code=" << record.code;
+    if (record.deadline_ns) {
+        out << " late=" << (record.timestamp_ns - record.deadline_ns) / NS_PER_US << "us";
+    }
+    out << COLOR_RESET << '\n';
+}
+
+void drain_log_rings() {
+    ostringstream batch;
+    lock_guard<mutex> lock(async_log.rings_mutex);
+    for (auto& ring : async_log.rings) {
+        size_t t = ring->tail.load(memory_order_relaxed);
+        size_t h = ring->head.load(memory_order_acquire);
+        for (; t != h; t++) format_record(batch, ring->records[t & (LOG_RING_SIZE - 1)]);
+        ring->tail.store(t, memory_order_release);
+
+        uint64_t dropped = ring->dropped.exchange(0, memory_order_relaxed);
+        if (dropped) {
+            batch << COLOR_YELLOW << "[DEBUG] " << dropped << " log records dropped" << COLOR_RESET << '\n';
+        }
+    }
+    string text = batch.str();
+    if (!text.empty()) cout << text << flush;
+}
+
+void stop_async_log() {
+    if (!async_log.running.exchange(false)) return;
+    async_log.worker.join();
+    drain_log_rings();
+}
+
+void start_async_log() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    async_log.realtime_offset_ns = ts.tv_sec * NS_PER_SEC + ts.tv_nsec - monotonic_ns();
+
+    local_log_ring();  // Register the caller's ring now, not on the first event
+    async_log.running = true;
+    async_log.worker = spawn_helper_thread([] {
+        while (async_log.running.load(memory_order_relaxed)) {
+            this_thread::sleep_for(chrono::milliseconds(LOG_FLUSH_INTERVAL_MS));
+            drain_log_rings();
+        }
+    });
+    atexit(stop_async_log);
+}
+
+// Runtime counters. Every thread owns one slot and only does relaxed
+// increments on it; readers sum all slots. Reading is async-signal-safe,
+// so SIGUSR1 can dump them from a signal handler.
+enum WriteErrorKind { WRITE_EAGAIN, WRITE_EINTR, WRITE_ENODEV, WRITE_EINVAL, WRITE_OTHER, WRITE_ERROR_KINDS };
+const char* const WRITE_ERROR_NAMES[WRITE_ERROR_KINDS] = {"EAGAIN", "EINTR", "ENODEV", "EINVAL", "other"};
+
+struct ThreadCounters {
+    atomic<uint64_t> events_sent{0};
+    atomic<uint64_t> frames_sent{0};
+    atomic<uint64_t> loop_iterations{0};
+    atomic<uint64_t> wakeups{0};  // Sleeps and event waits that returned
+    atomic<uint64_t> write_errors[WRITE_ERROR_KINDS] = {};
+    atomic<uint64_t> lateness[LATENESS_BUCKETS] = {};
+    atomic<uint64_t> lateness_sum_us{0};
+};
+
+// A thread reserves its slot with fetch_add and then publishes the
+// pointer, so readers skip slots that are reserved but not yet filled
+atomic<ThreadCounters*> counter_slots[MAX_COUNTER_THREADS] = {};
+atomic<int> counter_slot_count{0};
+ThreadCounters overflow_counters;  // Shared by threads beyond MAX_COUNTER_THREADS
+
+ThreadCounters& local_counters() {
+    thread_local ThreadCounters* counters = nullptr;
+    if (!counters) {
+        int slot = counter_slot_count.fetch_add(1, memory_order_relaxed);
+        if (slot < MAX_COUNTER_THREADS) {
+            counters = new ThreadCounters();
+            counter_slots[slot].store(counters, memory_order_release);
+        } else {
+            counters = &overflow_counters;
+        }
+    }
+    return *counters;
+}
+
+// Slots have a single writer, so a relaxed load + store is enough and
+// cheaper than a locked add. Threads sharing overflow_counters may lose
+// the odd increment, which is acceptable for statistics.
+inline void count_add(atomic<uint64_t>& counter, uint64_t n = 1) {
+    counter.store(counter.load(memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+void count_write_error(int err) {
+    WriteErrorKind kind = err == EAGAIN ? WRITE_EAGAIN : err == EINTR ? WRITE_EINTR
+                        : err == ENODEV ? WRITE_ENODEV : err == EINVAL ? WRITE_EINVAL : WRITE_OTHER;
+    count_add(local_counters().write_errors[kind]);
+}
+
+void count_lateness(int64_t late_ns) {
+    ThreadCounters& counters = local_counters();
+    uint64_t late_us = late_ns > 0 ? late_ns / NS_PER_US : 0;
+    int bucket = 0;
+    while (bucket < LATENESS_BUCKETS - 1 && late_us > (1ULL << bucket)) bucket++;
+    count_add(counters.lateness[bucket]);
+    count_add(counters.lateness_sum_us, late_us);
+}
+
+// Fixed-buffer text builder usable from a signal handler
+struct StatsText {
+    char data[8192];
+    size_t length = 0;
+
+    void add(const char* text) {
+        while (*text && length < sizeof(data)) data[length++] = *text++;
+    }
+    void add(uint64_t value) {
+        char digits[24];
+        int n = 0;
+        do { digits[n++] = '0' + value % 10; value /= 10; } while (value);
+        while (n && length < sizeof(data)) data[length++] = digits[--n];
+    }
+    void metric(const char* name, const char* labels, uint64_t value) {
+        add(name);
+        add(labels);
+        add(" ");
+        add(value);
+        add("\n");
+    }
+};
+
+int counter_slot_limit() {
+    return min(counter_slot_count.load(memory_order_relaxed), MAX_COUNTER_THREADS);
+}
+
+uint64_t sum_counter(atomic<uint64_t> ThreadCounters::*field) {
+    uint64_t total = (overflow_counters.*field).load(memory_order_relaxed);
+    for (int i = 0; i < counter_slot_limit(); i++) {
+        ThreadCounters* counters = counter_slots[i].load(memory_order_acquire);
+        if (counters) total += (counters->*field).load(memory_order_relaxed);
+    }
+    return total;
+}
+
+uint64_t sum_counter_array(atomic<uint64_t> (ThreadCounters::*field)[WRITE_ERROR_KINDS], int index) {
+    uint64_t total = (overflow_counters.*field)[index].load(memory_order_relaxed);
+    for (int i = 0; i < counter_slot_limit(); i++) {
+        ThreadCounters* counters = counter_slots[i].load(memory_order_acquire);
+        if (counters) total += (counters->*field)[index].load(memory_order_relaxed);
+    }
+    return total;
+}
+
+uint64_t sum_lateness_bucket(int index) {
+    uint64_t total = overflow_counters.lateness[index].load(memory_order_relaxed);
+    for (int i = 0; i < counter_slot_limit(); i++) {
+        ThreadCounters* counters = counter_slots[i].load(memory_order_acquire);
+        if (counters) total += counters->lateness[index].load(memory_order_relaxed);
+    }
+    return total;
+}
+
+// Prometheus text exposition of all counters
+void format_stats(StatsText& out) {
+    out.add("# TYPE mclick_events_sent_total counter\n");
+    out.metric("mclick_events_sent_total", "", sum_counter(&ThreadCounters::events_sent));
+    out.add("# TYPE mclick_frames_sent_total counter\n");
+    out.metric("mclick_frames_sent_total", "", sum_counter(&ThreadCounters::frames_sent));
+    out.add("# TYPE mclick_loop_iterations_total counter\n");
+    out.metric("mclick_loop_iterations_total", "", sum_counter(&ThreadCounters::loop_iterations));
+    out.add("# TYPE mclick_wakeups_total counter\n");
+    out.metric("mclick_wakeups_total", "", sum_counter(&ThreadCounters::wakeups));
+
+    out.add("# TYPE mclick_write_errors_total counter\n");
+    for (int kind = 0; kind < WRITE_ERROR_KINDS; kind++) {
+        out.add("mclick_write_errors_total{errno=\"");
+        out.add(WRITE_ERROR_NAMES[kind]);
+        out.metric("\"}", "", sum_counter_array(&ThreadCounters::write_errors, kind));
+    }
+
+    out.add("# TYPE mclick_lateness_microseconds histogram\n");
+    uint64_t cumulative = 0;
+    for (int bucket = 0; bucket < LATENESS_BUCKETS; bucket++) {
+        cumulative += sum_lateness_bucket(bucket);
+        out.add("mclick_lateness_microseconds_bucket{le=\"");
+        if (bucket < LATENESS_BUCKETS - 1) {
+            out.add(1ULL << bucket);
+        } else {
+            out.add("+Inf");
+        }
+        out.metric("\"}", "", cumulative);
+    }
+    out.metric("mclick_lateness_microseconds_sum", "", sum_counter(&ThreadCounters::lateness_sum_us));
+    out.metric("mclick_lateness_microseconds_count", "", cumulative);
+}
+
+void write_stats(int fd) {
+    StatsText text;
+    format_stats(text);
+    for (size_t written = 0; written < text.length;) {
+        ssize_t n = write(fd, text.data + written, text.length - written);
+        if (n <= 0) return;
+        written += n;
+    }
+}
+
+void handle_stats_signal(int) {
+    int saved_errno = errno;
+    write_stats(STDERR_FILENO);
+    errno = saved_errno;
+}
+
+void install_stats_handler() {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_stats_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, nullptr);
+}
+
+// Scheduled vs. actual time of one submitted frame, recorded by --bench
+struct TimingSample {
+    int64_t deadline_ns;
+    int64_t actual_ns;
+    int32_t value;
+};
+
+// Set by the benchmark to collect a TimingSample per frame on this thread
+thread_local vector<TimingSample>* click_trace = nullptr;
+
+// Closed loop for --cps. Every frame's lateness feeds an integrating
+// estimate of how long the wakeup and the write take, and the click loop
+// wakes that much before each deadline. The deadlines themselves stay on
+// the absolute grid, so the long-run rate is exact and only the phase is
+// corrected.
+struct RateControl {
+    int64_t lead_ns = 0;
+    int64_t first_press_ns = 0;
+    int64_t last_press_ns = 0;
+    uint64_t presses = 0;
+
+    void observe(const EventFrame& frame, int64_t now_ns) {
+        lead_ns += (now_ns - frame.deadline_ns) / 8;
+        lead_ns = max<int64_t>(0, min<int64_t>(lead_ns, MAX_WAKE_LEAD_NS));
+        const struct input_event* key = frame.key_edge();
+        if (!key || key->value != 1) return;
+        if (!presses++) first_press_ns = now_ns;
+        last_press_ns = now_ns;
+    }
+
+    double achieved_cps() const {
+        if (presses < 2) return 0;
+        return double(presses - 1) * NS_PER_SEC / (last_press_ns - first_press_ns);
+    }
+};
+
+// Installed by main for a single --cps stream
+thread_local RateControl* rate_control = nullptr;
+
+inline int64_t wake_lead() {
+    return rate_control ? rate_control->lead_ns : 0;
+}
+
+// Terminates the frame with SYN_REPORT and applies --timestamps, using
+// now_ns for monotonic stamps
+void seal_frame(EventFrame& frame, int64_t now_ns) {
+    struct input_event& syn = frame.events[frame.count];
+    memset(&syn, 0, sizeof(syn));
+    syn.type = EV_SYN;
+    syn.code = SYN_REPORT;
+
+    if (timestamp_mode != TIMESTAMP_KERNEL) {
+        struct timeval tv;
+        if (timestamp_mode == TIMESTAMP_MONOTONIC) {
+            tv.tv_sec = now_ns / NS_PER_SEC;
+            tv.tv_usec = now_ns % NS_PER_SEC / NS_PER_US;
+        } else {
+            gettimeofday(&tv, NULL);
+        }
+        for (int i = 0; i <= frame.count; i++) frame.events[i].time = tv;
+    }
+}
+
+// Bookkeeping for a frame that reached the device at now_ns: counters,
+// lateness, the benchmark trace and the debug log. now_ns is 0 when the
+// send time is unknown (io_uring); such frames are counted but stay out
+// of the lateness figures.
+template <bool Debug>
+void account_frame(const EventFrame& frame, int64_t now_ns) {
+    ThreadCounters& counters = local_counters();
+    count_add(counters.events_sent, frame.count + 1);
+    count_add(counters.frames_sent);
+    if (!frame.deadline_ns) return;
+
+    if (now_ns) {
+        count_lateness(now_ns - frame.deadline_ns);
+        if (click_trace) {
+            const struct input_event* key = frame.key_edge();
+            click_trace->push_back({frame.deadline_ns, now_ns, key ? key->value : 0});
+        }
+        if (rate_control) rate_control->observe(frame, now_ns);
+    }
+
+    if (Debug) {
+        // Unmeasured frames are logged at their deadline, without a lateness
+        const int64_t logged_ns = now_ns ? now_ns : frame.deadline_ns;
+        const int64_t deadline_ns = now_ns ? frame.deadline_ns : 0;
+        LogRing& ring = local_log_ring();
+        for (int i = 0; i < frame.count; i++) {
+            const struct input_event& ie = frame.events[i];
+            if (ie.type == EV_KEY) ring.push({logged_ns, deadline_ns, ie.type, ie.code, ie.value});
+        }
+    }
+}
+
+// Debug is a template parameter so the non-debug instantiation used by
+// the click loops carries no logging branch at all.
+template <bool Debug>
+void send_frame(int fd, EventFrame& frame) {
+    // At most one clock read per frame, shared by the event stamps,
+    // the lateness counters, the benchmark trace and the debug log
+    int64_t now_ns = 0;
+    if (frame.deadline_ns || timestamp_mode == TIMESTAMP_MONOTONIC) now_ns = monotonic_ns();
+    seal_frame(frame, now_ns);
+
+    size_t size = (frame.count + 1) * sizeof(struct input_event);
+    if (write(fd, frame.events, size) < 0) {
+        count_write_error(errno);
         cerr << COLOR_RED 
-             << "[ERROR] Failed to open uinput device: " << strerror(errno)
-             << endl << COLOR_GREEN
-             << "[HELP] Try running with sudo"
+             << "[ERROR] Failed to send event: " << strerror(errno)
+             << COLOR_RESET << endl;
+        return;
+    }
+    account_frame<Debug>(frame, now_ns);
+}
+
+// For callers off the specialized click loops
+void send_frame(int fd, EventFrame& frame) {
+    if (debug_mode) {
+        send_frame<true>(fd, frame);
+    } else {
+        send_frame<false>(fd, frame);
+    }
+}
+
+// Adds one click edge: the button change plus the motion that belongs
+// to the same instant, so the compositor gets one frame, not several
+void add_click_edge(EventFrame& frame, int button, int action, const PointerMotion& motion) {
+    int dx = action ? motion.move_x : motion.drag_x;
+    int dy = action ? motion.move_y : motion.drag_y;
+    if (dx) frame.add(EV_REL, REL_X, dx);
+    if (dy) frame.add(EV_REL, REL_Y, dy);
+    if (action && motion.wheel) frame.add(EV_REL, REL_WHEEL, motion.wheel);
+    frame.add(EV_KEY, button, action);
+}
+
+template <bool Debug>
+void send_event(int fd, int button, int action, int64_t deadline_ns, const PointerMotion& motion) {
+    EventFrame frame;
+    frame.deadline_ns = deadline_ns;
+    add_click_edge(frame, button, action, motion);
+    send_frame<Debug>(fd, frame);
+}
+
+// Per-thread absolute timer for sleep_until, closed with the thread
+struct SleepTimer {
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    ~SleepTimer() {
+        if (fd >= 0) close(fd);
+    }
+};
+
+// Sleeps until an absolute CLOCK_MONOTONIC deadline. Oversleeping one
+// deadline never shifts the next one, so timing errors do not accumulate.
+// Once the stop handler is installed the sleep is a poll on a timerfd
+// and stop_event_fd: a stop signal ends it wherever it lands, even
+// between the caller's last check and the syscall.
+void sleep_until(int64_t deadline_ns) {
+    if (stopping()) return;
+    deadline_ns = max<int64_t>(deadline_ns, 1);  // A zero it_value would disarm the timer
+    struct timespec ts;
+    ts.tv_sec = deadline_ns / NS_PER_SEC;
+    ts.tv_nsec = deadline_ns % NS_PER_SEC;
+
+    thread_local SleepTimer timer;
+    if (stop_event_fd >= 0 && timer.fd >= 0) {
+        // Re-arming also resets the expiration count, so nothing to drain
+        itimerspec spec = {};
+        spec.it_value = ts;
+        timerfd_settime(timer.fd, TFD_TIMER_ABSTIME, &spec, nullptr);
+        while (poll_or_stop(timer.fd, POLLIN, -1) < 0 && errno == EINTR && !stopping()) {}
+    } else {
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR && !stopping()) {}
+    }
+    count_add(local_counters().wakeups);
+}
+
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+// High-frequency wait: sleeps coarsely until SPIN_WINDOW_NS before the
+// deadline, then spins on the monotonic clock. Burns a core while
+// spinning but wakes within a few microseconds of the deadline.
+void spin_until(int64_t deadline_ns) {
+    if (deadline_ns - monotonic_ns() > SPIN_WINDOW_NS) {
+        sleep_until(deadline_ns - SPIN_WINDOW_NS);
+    }
+    while (monotonic_ns() < deadline_ns && !stopping()) cpu_relax();
+}
+
+template <bool HighFrequency>
+inline void wait_until(int64_t deadline_ns) {
+    if (HighFrequency) {
+        spin_until(deadline_ns);
+    } else {
+        sleep_until(deadline_ns);
+    }
+}
+
+auto now() {
+    return chrono::steady_clock::now();
+}
+
+bool has_option(int argc, char* argv[], const char* option) {
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], option) == 0) return true;
+    }
+    return false;
+}
+
+const char* get_option_value(int argc, char* argv[], const char* option) {
+    for (int i = 0; i < argc - 1; i++) {
+        if (strcmp(argv[i], option) == 0) return argv[i + 1];
+    }
+    return nullptr;
+}
+
+void warn_realtime(const string& what, const char* missing) {
+    cerr << COLOR_YELLOW << "[WARN] " << what << ": " << strerror(errno);
+    if (errno == EPERM) cerr << " (needs " << missing << ")";
+    cerr << ", continuing without it" << COLOR_RESET << endl;
+}
+
+// Applied to each clicking thread right before it starts. Every step is
+// best effort: a missing capability costs precision, never the run.
+// Pool worker i pins to --cpu plus i.
+void apply_scheduling_profile(int cpu_offset = 0) {
+    if (efficient_mode) {
+        if (prctl(PR_SET_TIMERSLACK, (unsigned long)EFFICIENT_WINDOW_NS, 0UL, 0UL, 0UL) < 0) {
+            warn_realtime("PR_SET_TIMERSLACK failed", "a newer kernel");
+        }
+        return;
+    }
+    if (!realtime_profile.enabled) return;
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        warn_realtime("mlockall failed", "CAP_IPC_LOCK or a larger RLIMIT_MEMLOCK");
+    }
+    if (prctl(PR_SET_TIMERSLACK, 1UL, 0UL, 0UL, 0UL) < 0) {
+        warn_realtime("PR_SET_TIMERSLACK failed", "a newer kernel");
+    }
+    const int cpu = realtime_profile.cpu >= 0 ? realtime_profile.cpu + cpu_offset : -1;
+    if (cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if (int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus)) {
+            errno = err;
+            warn_realtime("Failed to pin to CPU " + to_string(cpu), "an allowed CPU");
+        }
+    }
+
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = realtime_profile.priority;
+    if (int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)) {
+        errno = err;
+        warn_realtime("SCHED_FIFO unavailable", "CAP_SYS_NICE or RLIMIT_RTPRIO");
+    } else if (debug_mode) {
+        cout << COLOR_YELLOW << "[DEBUG] Realtime: SCHED_FIFO priority " << realtime_profile.priority
+             << (cpu >= 0 ? ", cpu " + to_string(cpu) : "")
              << COLOR_RESET << endl;
-        exit(EXIT_FAILURE);
     }
+}
+
+// Options that apply to the whole process and may appear anywhere on the
+// command line. Returns how many values follow the option, or -1.
+int global_option_arity(const string& arg) {
+    if (arg == "-s" || arg == "--socket" || arg == "--ready-timeout" ||
+        arg == "--rt-priority" || arg == "--cpu" || arg == "--timestamps") return 1;
+    if (arg == "--realtime" || arg == "--efficient" || arg == "--stats") return 0;
+    return -1;
+}
+
+int parse_int(const char* str, int min_value, int max_value) {
+    char* end = nullptr;
+    errno = 0;
+    long value = strtol(str, &end, 10);
+    if (end != str && *end == '\0' && errno == 0 && value >= min_value && value <= max_value) return value;
+    throw invalid_argument(string("Invalid number: ") + str);
+}
+
+// Parses "<n>[ns|us|ms|s]" into nanoseconds; a bare number means ms.
+int64_t parse_duration(const char* duration_str) {
+    static const struct { const char* suffix; int64_t scale; } UNITS[] = {
+        {"", NS_PER_MS}, {"ms", NS_PER_MS}, {"s", NS_PER_SEC}, {"us", NS_PER_US}, {"ns", 1},
+    };
+
+    // strtoll rather than strings, so --stdin can parse without allocating
+    char* suffix = nullptr;
+    errno = 0;
+    long long value = strtoll(duration_str, &suffix, 10);
+    if (isdigit((unsigned char)duration_str[0]) && errno == 0 && value > 0) {
+        for (const auto& unit : UNITS) {
+            if (strcmp(suffix, unit.suffix) != 0) continue;
+            if (value <= INT64_MAX / unit.scale) return value * unit.scale;
+        }
+    }
+    throw invalid_argument(string("Invalid duration: ") + duration_str);
+}
+
+void parse_global_options(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--realtime") {
+            realtime_profile.enabled = true;
+        } else if (arg == "--efficient") {
+            efficient_mode = true;
+        } else if (arg == "--stats") {
+            print_stats_at_exit = true;
+        } else if (i + 1 >= argc) {
+            break;
+        } else if (arg == "--ready-timeout") {
+            ready_timeout_ns = strcmp(argv[++i], "0") == 0 ? 0 : parse_duration(argv[i]);
+        } else if (arg == "--rt-priority") {
+            realtime_profile.priority = parse_int(argv[++i], sched_get_priority_min(SCHED_FIFO),
+                                                  sched_get_priority_max(SCHED_FIFO));
+        } else if (arg == "--cpu") {
+            realtime_profile.cpu = parse_int(argv[++i], 0, CPU_SETSIZE - 1);
+        } else if (arg == "--timestamps") {
+            string mode = argv[++i];
+            if (mode == "kernel") {
+                timestamp_mode = TIMESTAMP_KERNEL;
+            } else if (mode == "monotonic") {
+                timestamp_mode = TIMESTAMP_MONOTONIC;
+            } else if (mode == "realtime") {
+                timestamp_mode = TIMESTAMP_REALTIME;
+            } else {
+                throw invalid_argument("Invalid timestamp mode: " + mode);
+            }
+        }
+    }
+    if (efficient_mode && realtime_profile.enabled) {
+        throw invalid_argument("--efficient and --realtime are opposite profiles, pick one");
+    }
+}
+
+// Button letter to BTN_* code, -1 if unknown
+int lookup_button(char name) {
+    for (const ButtonName& button : BUTTONS) {
+        if (button.name == name) return button.code;
+    }
+    return -1;
+}
+
+// "dx,dy" for --move and --drag
+void parse_offset(const string& str, int& x, int& y) {
+    int consumed = 0;
+    if (sscanf(str.c_str(), "%d,%d%n", &x, &y, &consumed) != 2 || consumed != (int)str.size()) {
+        throw invalid_argument("Invalid offset, expected dx,dy: " + str);
+    }
+}
+
+// Positive decimal such as a --cps rate or a --duty fraction
+double parse_fraction(const string& str, const char* what) {
+    char* end = nullptr;
+    double value = strtod(str.c_str(), &end);
+    if (str.empty() || *end || !(value > 0)) {
+        throw invalid_argument(string("Invalid ") + what + ": " + str);
+    }
+    return value;
+}
+
+// Key names for --hotkey: the KEY_* suffix in any case, e.g. F8, a,
+// scrolllock, or a raw code. A constant table, searched linearly once.
+int lookup_key(string name) {
+    static const struct { const char* name; int code; } KEYS[] = {
+        {"ESC", KEY_ESC}, {"TAB", KEY_TAB}, {"SPACE", KEY_SPACE}, {"ENTER", KEY_ENTER},
+        {"BACKSPACE", KEY_BACKSPACE}, {"CAPSLOCK", KEY_CAPSLOCK}, {"NUMLOCK", KEY_NUMLOCK},
+        {"SCROLLLOCK", KEY_SCROLLLOCK}, {"PAUSE", KEY_PAUSE}, {"SYSRQ", KEY_SYSRQ},
+        {"INSERT", KEY_INSERT}, {"DELETE", KEY_DELETE}, {"HOME", KEY_HOME}, {"END", KEY_END},
+        {"PAGEUP", KEY_PAGEUP}, {"PAGEDOWN", KEY_PAGEDOWN},
+        {"UP", KEY_UP}, {"DOWN", KEY_DOWN}, {"LEFT", KEY_LEFT}, {"RIGHT", KEY_RIGHT},
+        {"LEFTSHIFT", KEY_LEFTSHIFT}, {"RIGHTSHIFT", KEY_RIGHTSHIFT}, {"LEFTCTRL", KEY_LEFTCTRL},
+        {"RIGHTCTRL", KEY_RIGHTCTRL}, {"LEFTALT", KEY_LEFTALT}, {"RIGHTALT", KEY_RIGHTALT},
+        {"LEFTMETA", KEY_LEFTMETA}, {"RIGHTMETA", KEY_RIGHTMETA},
+        {"GRAVE", KEY_GRAVE}, {"MINUS", KEY_MINUS}, {"EQUAL", KEY_EQUAL},
+        {"F1", KEY_F1}, {"F2", KEY_F2}, {"F3", KEY_F3}, {"F4", KEY_F4}, {"F5", KEY_F5}, {"F6", KEY_F6},
+        {"F7", KEY_F7}, {"F8", KEY_F8}, {"F9", KEY_F9}, {"F10", KEY_F10}, {"F11", KEY_F11}, {"F12", KEY_F12},
+        {"F13", KEY_F13}, {"F14", KEY_F14}, {"F15", KEY_F15}, {"F16", KEY_F16}, {"F17", KEY_F17},
+        {"F18", KEY_F18}, {"F19", KEY_F19}, {"F20", KEY_F20}, {"F21", KEY_F21}, {"F22", KEY_F22},
+        {"F23", KEY_F23}, {"F24", KEY_F24},
+        {"1", KEY_1}, {"2", KEY_2}, {"3", KEY_3}, {"4", KEY_4}, {"5", KEY_5},
+        {"6", KEY_6}, {"7", KEY_7}, {"8", KEY_8}, {"9", KEY_9}, {"0", KEY_0},
+        {"A", KEY_A}, {"B", KEY_B}, {"C", KEY_C}, {"D", KEY_D}, {"E", KEY_E}, {"F", KEY_F},
+        {"G", KEY_G}, {"H", KEY_H}, {"I", KEY_I}, {"J", KEY_J}, {"K", KEY_K}, {"L", KEY_L},
+        {"M", KEY_M}, {"N", KEY_N}, {"O", KEY_O}, {"P", KEY_P}, {"Q", KEY_Q}, {"R", KEY_R},
+        {"S", KEY_S}, {"T", KEY_T}, {"U", KEY_U}, {"V", KEY_V}, {"W", KEY_W}, {"X", KEY_X},
+        {"Y", KEY_Y}, {"Z", KEY_Z},
+        {"BTN_SIDE", BTN_SIDE}, {"BTN_EXTRA", BTN_EXTRA},
+    };
+    for (char& c : name) c = toupper(c);
+    if (name.compare(0, 4, "KEY_") == 0) name.erase(0, 4);
+    for (const auto& key : KEYS) {
+        if (name == key.name) return key.code;
+    }
+    if (!name.empty() && all_of(name.begin(), name.end(), ::isdigit)) {
+        return parse_int(name.c_str(), 1, KEY_MAX);
+    }
+    throw invalid_argument("Unknown key: " + name);
+}
+
+JitterDist parse_jitter_dist(const string& name) {
+    if (name == "uniform") return JITTER_UNIFORM;
+    if (name == "normal") return JITTER_NORMAL;
+    if (name == "lognormal") return JITTER_LOGNORMAL;
+    throw invalid_argument("Unknown jitter distribution: " + name);
+}
+
+// Splits one --cps period into hold and speed by the duty cycle. The
+// period is rounded to a whole nanosecond, which keeps the rate within
+// 1e-6 of the target even at 1000 clicks per second.
+void apply_target_rate(ClickJob& job, double duty) {
+    int64_t period_ns = llround(NS_PER_SEC / job.target_cps);
+    if (period_ns < 2) throw invalid_argument("Click rate too high");
+    job.hold_ns = max<int64_t>(1, min<int64_t>(period_ns - 1, llround(period_ns * duty)));
+    job.click_speed_ns = period_ns - job.hold_ns;
+}
+
+// Which timings an option sets, for updates that must leave the others at
+// their live values (mclick ctl, daemon rate). --cps sets both.
+void note_timing_option(const string& arg, bool& sets_hold, bool& sets_speed) {
+    bool rate = arg == "--cps" || arg == "--rate";
+    sets_hold = sets_hold || rate || arg == "-h" || arg == "--hold";
+    sets_speed = sets_speed || rate || arg == "-cs" || arg == "--clickspeed";
+}
+
+// Parses "<button> [count] [options] [<button> [count] [options]]..."
+// where argv[1] is the first button; every further button letter starts
+// another stream. Throws invalid_argument so the daemon can reject a bad
+// request without exiting.
+ClickRequest parse_click_args(int argc, char* argv[]) {
+    ClickRequest request;
+    vector<double> duties = {DEFAULT_DUTY};
+    vector<bool> fixed_timing = {false};
+    vector<bool> counted = {false};
+
+    if (argc < 2 || lookup_button(argv[1][0]) < 0) {
+        throw invalid_argument(string("Invalid button: ") + (argc < 2 ? "" : argv[1]));
+    }
+    request.streams.emplace_back();
+    request.streams.back().button = lookup_button(argv[1][0]);
+
+    for (int i = 2; i < argc; ++i) {
+        string arg = argv[i];
+        ClickJob& job = request.streams.back();
+        
+        if (arg == "-d" || arg == "--debug") {
+            request.debug = true;
+        } 
+        else if ((arg == "-h" || arg == "--hold") && i + 1 < argc) {
+            job.hold_ns = parse_duration(argv[++i]);
+            fixed_timing.back() = true;
+        }
+        else if ((arg == "-cs" || arg == "--clickspeed") && i + 1 < argc) {
+            job.click_speed_ns = parse_duration(argv[++i]);
+            fixed_timing.back() = true;
+        }
+        else if ((arg == "--cps" || arg == "--rate") && i + 1 < argc) {
+            job.target_cps = parse_fraction(argv[++i], "click rate");
+        }
+        else if (arg == "--duty" && i + 1 < argc) {
+            duties.back() = parse_fraction(argv[++i], "duty cycle");
+            if (duties.back() >= 1) throw invalid_argument("Duty cycle must be below 1");
+        }
+        else if ((arg == "-t" || arg == "--time") && i + 1 < argc) {
+            job.duration_ns = parse_duration(argv[++i]);
+        }
+        else if (arg == "-hf" || arg == "--high-frequency") {
+            job.high_frequency = true;
+        }
+        else if (arg == "--jitter" && i + 1 < argc) {
+            job.jitter_ns = parse_duration(argv[++i]);
+        }
+        else if (arg == "--jitter-dist" && i + 1 < argc) {
+            job.jitter_dist = parse_jitter_dist(argv[++i]);
+        }
+        else if (arg == "--hotkey" && i + 2 < argc) {
+            request.hotkey_node = argv[++i];
+            request.hotkey = lookup_key(argv[++i]);
+        }
+        else if (arg == "--toggle") {
+            request.toggle = true;
+        }
+        else if (arg == "--shm" && i + 1 < argc) {
+            request.shm_name = argv[++i];
+        }
+        else if (arg == "--device" && i + 1 < argc) {
+            request.device = parse_int(argv[++i], 0, MAX_POOL_DEVICES - 1);
+        }
+        else if (arg == "--move" && i + 1 < argc) {
+            parse_offset(argv[++i], job.motion.move_x, job.motion.move_y);
+        }
+        else if (arg == "--drag" && i + 1 < argc) {
+            parse_offset(argv[++i], job.motion.drag_x, job.motion.drag_y);
+        }
+        else if (arg == "--wheel" && i + 1 < argc) {
+            job.motion.wheel = parse_int(argv[++i], -127, 127);
+        }
+        else if (arg == "--burst" && i + 1 < argc) {
+            job.burst = parse_int(argv[++i], 1, INT32_MAX);
+        }
+        else if (global_option_arity(arg) >= 0) {
+            i += global_option_arity(arg); // Consumed by main
+        }
+        else if (isdigit(arg[0])) {
+            try {
+                job.count = stoi(arg);
+                counted.back() = true;
+            } catch (...) {
+                throw invalid_argument("Invalid count: " + arg);
+            }
+        }
+        else if (arg.size() == 1 && lookup_button(arg[0]) >= 0) {
+            request.streams.emplace_back();
+            request.streams.back().button = lookup_button(arg[0]);
+            duties.push_back(DEFAULT_DUTY);
+            fixed_timing.push_back(false);
+            counted.push_back(false);
+        }
+    }
+
+    for (size_t i = 0; i < request.streams.size(); i++) {
+        ClickJob& job = request.streams[i];
+        if (job.target_cps > 0) {
+            if (fixed_timing[i]) throw invalid_argument("--cps replaces -h and -cs, use --duty instead");
+            apply_target_rate(job, duties[i]);
+        }
+        // Under a hotkey, streams without -t or a count click until the key says stop
+        if (request.hotkey >= 0 && !counted[i] && job.duration_ns == 0) job.count = INT32_MAX;
+        // Offsets of up to half a hold or gap could swap a press and its release
+        if (job.jitter_ns > 0 && 2 * job.jitter_ns >= min(job.hold_ns, job.click_speed_ns)) {
+            throw invalid_argument("--jitter must stay below half of the hold and the delay");
+        }
+        // Sub-2ms timing is beyond what a plain sleep can hit reliably,
+        // but --efficient never spins
+        if (efficient_mode) {
+            if (job.high_frequency) throw invalid_argument("-hf spins, which --efficient never does");
+        } else if (job.hold_ns < HIGH_FREQUENCY_THRESHOLD_NS ||
+                   job.click_speed_ns < HIGH_FREQUENCY_THRESHOLD_NS) {
+            job.high_frequency = true;
+        }
+    }
+    if (request.toggle && request.hotkey < 0) throw invalid_argument("--toggle needs --hotkey");
+    if (!request.shm_name.empty() && (request.streams.size() > 1 || request.hotkey >= 0 ||
+                                      request.streams[0].burst > 0)) {
+        throw invalid_argument("--shm steers one timed or counted stream");
+    }
+    return request;
+}
+
+// Picks up --shm changes between two clicks, while the button is up.
+// Waits out a pause, after which `released_at` moves to now so no burst
+// of missed clicks follows. Returns false when the run should stop.
+bool poll_control(int64_t& hold_ns, int64_t& click_speed_ns, int64_t& released_at) {
+    ControlBlock& block = *control_block;
+    while (block.paused.load(memory_order_relaxed) && !block.stop.load(memory_order_relaxed) && !stopping()) {
+        sleep_until(monotonic_ns() + CONTROL_POLL_NS);
+        released_at = max(released_at, monotonic_ns());
+    }
+    if (block.stop.load(memory_order_relaxed) || stopping()) return false;
+    hold_ns = max<int64_t>(1, block.hold_ns.load(memory_order_relaxed));
+    click_speed_ns = max<int64_t>(1, block.click_speed_ns.load(memory_order_relaxed));
+    return true;
+}
+
+inline void count_control_click(int64_t press_at) {
+    count_add(control_block->clicks);
+    control_block->last_click_ns.store(press_at, memory_order_relaxed);
+}
+
+// Both loops step the grid as release + speed rather than start + i *
+// period. With fixed timings that is the same schedule; with --shm a new
+// hold or speed rebases the grid at the next click without any drift.
+template <bool Debug, bool HighFrequency>
+void perform_clicks(int fd, int button, const PointerMotion& motion, int count, int64_t hold_ns,
+                    int64_t click_speed_ns, Jitter& jitter) {
+    int64_t cycle_at = monotonic_ns();
+
+    atomic<uint64_t>& iterations = local_counters().loop_iterations;
+
+    for (int i = 0; i < count; i++) {
+        count_add(iterations);
+        int64_t press_at = cycle_at + jitter.next();
+        int64_t release_at = max(cycle_at + hold_ns + jitter.next(), press_at + 1);
+        wait_until<HighFrequency>(press_at - wake_lead());
+        if (stopping()) break;
+        send_event<Debug>(fd, button, 1, press_at, motion);
+        if (control_block) count_control_click(press_at);
+        // A stop cuts the hold short but the release always goes out
+        wait_until<HighFrequency>(release_at - wake_lead());
+        send_event<Debug>(fd, button, 0, release_at, motion);
+        if (stopping()) break;
+
+        int64_t released_at = cycle_at + hold_ns;
+        if (control_block && !poll_control(hold_ns, click_speed_ns, released_at)) break;
+        cycle_at = released_at + click_speed_ns;
+    }
+}
+
+template <bool Debug, bool HighFrequency>
+void perform_timed_clicks(int fd, int button, const PointerMotion& motion, int64_t duration_ns,
+                          int64_t hold_ns, int64_t click_speed_ns, Jitter& jitter) {
+    if (Debug) {
+        cout << COLOR_YELLOW << "[DEBUG] Timed clicks: " << format_duration(duration_ns)
+             << " (hold=" << format_duration(hold_ns) << ", speed=" << format_duration(click_speed_ns)
+             << (HighFrequency ? ", high-frequency" : "") << ")"
+             << COLOR_RESET << endl;
+    }
+
+    const int64_t start = monotonic_ns();
+    const int64_t end = start + duration_ns;
+
+    atomic<uint64_t>& iterations = local_counters().loop_iterations;
+
+    for (int64_t cycle_at = start; cycle_at < end;) {
+        count_add(iterations);
+        // After a stall of a whole cycle or more, drop the missed cycles
+        // instead of bursting through them, keeping the original phase
+        const int64_t period_ns = hold_ns + click_speed_ns;
+        int64_t behind = monotonic_ns() - cycle_at;
+        if (behind >= period_ns) {
+            cycle_at += behind / period_ns * period_ns;
+            if (cycle_at >= end) break;
+        }
+
+        int64_t press_at = cycle_at + jitter.next();
+        if (press_at >= end) break;
+        wait_until<HighFrequency>(press_at - wake_lead());
+        if (stopping()) break;
+        send_event<Debug>(fd, button, 1, press_at, motion);
+        if (control_block) count_control_click(press_at);
+        // The last release lands exactly on the deadline
+        int64_t release_at = min(max(cycle_at + hold_ns + jitter.next(), press_at + 1), end);
+        wait_until<HighFrequency>(release_at - wake_lead());
+        send_event<Debug>(fd, button, 0, release_at, motion);
+        if (stopping()) break;
+
+        int64_t released_at = cycle_at + hold_ns;
+        if (control_block && !poll_control(hold_ns, click_speed_ns, released_at)) break;
+        cycle_at = released_at + click_speed_ns;
+    }
+}
+
+// One stream on the multi-stream scheduler: the same press/release
+// cycle as perform_clicks/perform_timed_clicks, advanced one event at a
+// time so many streams can share one thread and one device.
+struct ClickStream {
+    ClickJob job;
+    uint64_t tag = 0;        // Caller's handle, e.g. the daemon's job id
+    uint64_t generation = 0; // Bumped to invalidate queued heap entries
+    int64_t press_at = 0;    // Next press deadline
+    int64_t press_offset = 0; // --jitter offset of the next press from the grid
+    int64_t release_at = 0;  // Pending release deadline while pressed
+    int64_t released_at = 0; // Last release, 0 before the first click
+    int64_t end = 0;         // Timed streams stop here, 0 for counted ones
+    int remaining = 0;       // Counted streams: clicks left
+    bool pressed = false;
+    bool active = false;
+    bool cancelled = false;  // Finish after the pending release
+    Jitter jitter;
+
+    int64_t next_deadline() const { return pressed ? release_at : press_at + press_offset; }
+    int64_t period() const { return job.hold_ns + job.click_speed_ns; }
+};
+
+// Multiplexes any number of click streams through a min-heap of
+// deadlines. Every event due at the same instant goes out in one frame.
+// Cancelled and retimed streams leave stale heap entries behind, which
+// are skipped by generation instead of searched for and removed.
+class ClickScheduler {
+public:
+    // Returns false when the job has nothing to click
+    bool add(const ClickJob& job, int64_t start, uint64_t tag = 0) {
+        ClickStream stream;
+        stream.job = job;
+        stream.tag = tag;
+        stream.press_at = start;
+        stream.end = job.duration_ns > 0 ? start + job.duration_ns : 0;
+        stream.remaining = job.count;
+        stream.active = true;
+        if (stream.end ? stream.press_at >= stream.end : stream.remaining <= 0) return false;
+        stream.jitter = Jitter(job);
+        stream.press_offset = stream.jitter.next();
+
+        // Moved, the jitter table is 8 KiB
+        size_t index = streams.size();
+        if (free_slots.empty()) {
+            streams.push_back(move(stream));
+        } else {
+            index = free_slots.back();
+            free_slots.pop_back();
+            stream.generation = streams[index].generation + 1;
+            streams[index] = move(stream);
+        }
+        high_frequency = high_frequency || job.high_frequency;
+        align_ns = min({align_ns, job.hold_ns, job.click_speed_ns});
+        push(index);
+        return true;
+    }
+
+    bool empty() {
+        prune();
+        return heap.empty();
+    }
+
+    int64_t next_deadline() {
+        prune();
+        return heap.top().deadline;
+    }
+
+    // When to wake for the next deadline. With --efficient it is rounded
+    // up onto a grid shared by all streams, and dispatch_due() at that
+    // instant takes everything up to it in one frame. The grid is never
+    // coarser than the shortest hold or gap still running, and widens
+    // again once such a stream has finished.
+    int64_t wake_deadline() {
+        int64_t deadline = next_deadline();
+        if (!efficient_mode) return deadline;
+        if (align_stale) update_alignment();
+        return (deadline + align_ns - 1) / align_ns * align_ns;
+    }
+
+    // Fires every event due at or before `deadline` as a single frame.
+    // Tags of streams that finish are appended to `finished`.
+    void dispatch_due(int fd, int64_t deadline, vector<uint64_t>* finished = nullptr) {
+        EventFrame frame;
+        frame.deadline_ns = deadline;
+        const int64_t now = monotonic_ns();
+
+        while (!empty() && heap.top().deadline <= deadline) {
+            size_t index = heap.top().index;
+            heap.pop();
+            if (frame.count + MAX_EDGE_EVENTS > MAX_FRAME_EVENTS - 1) {
+                send_frame(fd, frame);
+                frame.count = 0;
+            }
+            if (advance(streams[index], frame, now)) {
+                // One edge per stream per frame: a release never shares its
+                // press's frame, nor a press the previous release's, even
+                // when a coarse grid has made both due; it takes the next step
+                push(index, deadline + 1);
+            } else {
+                retire(index, finished);
+            }
+        }
+        if (frame.count > 0) send_frame(fd, frame);
+    }
+
+    // Stops every stream carrying `tag`. A held button is released right
+    // away; idle streams finish immediately. Returns false for unknown tags.
+    bool cancel(uint64_t tag, vector<uint64_t>* finished = nullptr) {
+        bool found = false;
+        for (size_t index = 0; index < streams.size(); index++) {
+            ClickStream& stream = streams[index];
+            if (!stream.active || stream.tag != tag) continue;
+            found = true;
+            if (stream.pressed) {
+                stream.cancelled = true;
+                stream.release_at = min(stream.release_at, monotonic_ns());
+                stream.generation++;
+                push(index);
+            } else {
+                retire(index, finished);
+            }
+        }
+        return found;
+    }
+
+    // Changes hold and speed of every stream carrying `tag`; a negative
+    // value keeps the stream's current one. The pending event moves to
+    // where the new timings put it, later cycles follow.
+    bool retime(uint64_t tag, int64_t new_hold_ns, int64_t new_click_speed_ns) {
+        bool found = false;
+        for (size_t index = 0; index < streams.size(); index++) {
+            ClickStream& stream = streams[index];
+            if (!stream.active || stream.tag != tag || stream.cancelled) continue;
+            found = true;
+            if (new_hold_ns >= 0) stream.job.hold_ns = new_hold_ns;
+            if (new_click_speed_ns >= 0) stream.job.click_speed_ns = new_click_speed_ns;
+            const int64_t hold_ns = stream.job.hold_ns, click_speed_ns = stream.job.click_speed_ns;
+            if (stream.pressed) {
+                stream.release_at = stream.press_at + hold_ns;
+                if (stream.end) stream.release_at = min(stream.release_at, stream.end);
+            } else if (stream.released_at) {
+                stream.press_at = stream.released_at + click_speed_ns;
+            }
+            high_frequency = high_frequency || (!efficient_mode && (hold_ns < HIGH_FREQUENCY_THRESHOLD_NS ||
+                                                                    click_speed_ns < HIGH_FREQUENCY_THRESHOLD_NS));
+            align_stale = true;
+            stream.generation++;
+            push(index);
+        }
+        return found;
+    }
+
+    bool needs_spin() const { return high_frequency; }
+
+    // Releases every held button at once and drops all streams
+    void release_all(int fd) {
+        EventFrame frame;
+        for (size_t index = 0; index < streams.size(); index++) {
+            ClickStream& stream = streams[index];
+            if (!stream.active) continue;
+            if (stream.pressed) {
+                if (frame.count == MAX_FRAME_EVENTS - 1) {
+                    send_frame(fd, frame);
+                    frame.count = 0;
+                }
+                frame.add(EV_KEY, stream.job.button, 0);
+            }
+            retire(index, nullptr);
+        }
+        if (frame.count > 0) send_frame(fd, frame);
+    }
+
+    // Streams are all added before this, so the spin choice is made once
+    void run(int fd) {
+        if (high_frequency) {
+            run_loop<true>(fd);
+        } else {
+            run_loop<false>(fd);
+        }
+    }
+
+private:
+    template <bool HighFrequency>
+    void run_loop(int fd) {
+        atomic<uint64_t>& iterations = local_counters().loop_iterations;
+        while (!empty()) {
+            count_add(iterations);
+            int64_t deadline = wake_deadline();
+            wait_until<HighFrequency>(deadline);
+            if (stopping()) {
+                release_all(fd);
+                return;
+            }
+            dispatch_due(fd, deadline);
+        }
+    }
+
+    // Adds the stream's due event to the frame. Returns false once the
+    // stream has finished.
+    static bool advance(ClickStream& stream, EventFrame& frame, int64_t now) {
+        if (stream.pressed) {
+            add_click_edge(frame, stream.job.button, 0, stream.job.motion);
+            stream.pressed = false;
+            stream.released_at = stream.release_at;
+            if (stream.cancelled) return false;
+            stream.press_at += stream.period();
+            stream.press_offset = stream.jitter.next();
+            if (stream.end) return stream.press_at + stream.press_offset < stream.end;
+            return --stream.remaining > 0;
+        }
+
+        // Timed streams drop whole cycles lost to a stall, like perform_timed_clicks
+        int64_t behind = now - stream.press_at;
+        if (stream.end && behind >= stream.period()) {
+            stream.press_at += behind / stream.period() * stream.period();
+            if (stream.press_at >= stream.end) return false;
+        }
+
+        add_click_edge(frame, stream.job.button, 1, stream.job.motion);
+        stream.pressed = true;
+        // Jitter may not reorder the release before its press
+        stream.release_at = max(stream.press_at + stream.job.hold_ns + stream.jitter.next(),
+                                stream.press_at + stream.press_offset + 1);
+        if (stream.end) stream.release_at = min(stream.release_at, stream.end);
+        return true;
+    }
+
+    void push(size_t index, int64_t not_before = 0) {
+        heap.push({max(streams[index].next_deadline(), not_before), index, streams[index].generation});
+    }
+
+    void update_alignment() {
+        align_ns = EFFICIENT_WINDOW_NS;
+        for (const ClickStream& stream : streams) {
+            if (stream.active) align_ns = min({align_ns, stream.job.hold_ns, stream.job.click_speed_ns});
+        }
+        align_stale = false;
+    }
+
+    void retire(size_t index, vector<uint64_t>* finished) {
+        align_stale = true;
+        streams[index].active = false;
+        streams[index].generation++;
+        free_slots.push_back(index);
+        if (finished) finished->push_back(streams[index].tag);
+    }
+
+    // Drops heap entries left behind by cancel and retime
+    void prune() {
+        while (!heap.empty()) {
+            const Entry& top = heap.top();
+            const ClickStream& stream = streams[top.index];
+            if (stream.active && stream.generation == top.generation) return;
+            heap.pop();
+        }
+    }
+
+    struct Entry {
+        int64_t deadline;
+        size_t index;  // Into streams
+        uint64_t generation;
+        bool operator>(const Entry& other) const { return deadline > other.deadline; }
+    };
+    vector<ClickStream> streams;
+    vector<size_t> free_slots;
+    priority_queue<Entry, vector<Entry>, greater<Entry>> heap;
+    bool high_frequency = false;
+    int64_t align_ns = EFFICIENT_WINDOW_NS;  // --efficient wakeup grid
+    bool align_stale = false;                // A stream left or was retimed
+};
+
+// Writes `clicks` complete clicks (press, SYN, release, SYN) back to back
+// from one preallocated buffer, as few writes as the kernel allows and no
+// sleeps, to find the ceiling of the input stack behind the device.
+void perform_burst(int fd, int button, int clicks) {
+    const int chunk_clicks = min(clicks, BURST_CHUNK_CLICKS);
+    vector<struct input_event> buffer(chunk_clicks * 4);  // Zeroed, the kernel stamps them
+    for (int i = 0; i < chunk_clicks; i++) {
+        struct input_event* click = &buffer[i * 4];
+        click[0].type = click[2].type = EV_KEY;
+        click[0].code = click[2].code = button;
+        click[0].value = 1;
+        click[1].type = click[3].type = EV_SYN;
+        click[1].code = click[3].code = SYN_REPORT;
+    }
+
+    ThreadCounters& counters = local_counters();
+    uint64_t writes = 0, retries = 0;
+    const int64_t start = monotonic_ns();
+
+    // Every chunk ends on a release, so stopping between chunks leaves nothing held
+    int left = clicks;
+    while (left > 0 && !stopping()) {
+        int batch = min(left, chunk_clicks);
+        const char* data = (const char*)buffer.data();
+        size_t size = batch * 4 * sizeof(struct input_event);
+        while (size > 0) {
+            ssize_t n = write(fd, data, size);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                count_write_error(errno);
+                if (errno != EAGAIN) {
+                    throw runtime_error(string("Failed to send burst: ") + strerror(errno));
+                }
+                // The device is full: wait for room instead of dropping clicks
+                retries++;
+                struct pollfd ready = {fd, POLLOUT, 0};
+                if (poll(&ready, 1, 1) <= 0) sched_yield();
+                continue;
+            }
+            // uinput consumes whole events, so a short write ends on a boundary
+            writes++;
+            data += n;
+            size -= n;
+        }
+        count_add(counters.events_sent, batch * 4);
+        count_add(counters.frames_sent, batch * 2);
+        left -= batch;
+    }
+
+    const int64_t elapsed = max<int64_t>(monotonic_ns() - start, 1);
+    clicks -= left;
+    cout << COLOR_BLUE << "[INFO] Burst: " << clicks << " clicks, " << clicks * 4LL << " events in "
+         << fixed << setprecision(1) << elapsed / 1000.0 << "us over " << writes << " writes (" << retries
+         << " EAGAIN retries), " << setprecision(0) << clicks * 4.0 * NS_PER_SEC / elapsed
+         << " events/s" << COLOR_RESET << endl;
+}
+
+template <bool Debug, bool Timed, bool HighFrequency>
+void click_loop(int fd, const ClickJob& job) {
+    Jitter jitter(job);
+    if (Timed) {
+        perform_timed_clicks<Debug, HighFrequency>(fd, job.button, job.motion, job.duration_ns, job.hold_ns,
+                                                   job.click_speed_ns, jitter);
+    } else {
+        perform_clicks<Debug, HighFrequency>(fd, job.button, job.motion, job.count, job.hold_ns,
+                                             job.click_speed_ns, jitter);
+    }
+}
+
+typedef void (*ClickLoop)(int fd, const ClickJob& job);
+
+// Indexed by [debug][timed][high_frequency]
+const ClickLoop CLICK_LOOPS[2][2][2] = {
+    {{click_loop<false, false, false>, click_loop<false, false, true>},
+     {click_loop<false, true, false>, click_loop<false, true, true>}},
+    {{click_loop<true, false, false>, click_loop<true, false, true>},
+     {click_loop<true, true, false>, click_loop<true, true, true>}},
+};
+
+// Picks the specialized loop once per job instead of branching per event
+void run_job(int fd, const ClickJob& job) {
+    if (job.burst > 0) {
+        perform_burst(fd, job.button, job.burst);
+        return;
+    }
+    CLICK_LOOPS[debug_mode.load()][job.duration_ns > 0][job.high_frequency](fd, job);
+}
+
+// A single stream keeps the dedicated loops; several share the scheduler
+void run_request(int fd, const ClickRequest& request) {
+    if (request.streams.size() == 1) {
+        run_job(fd, request.streams[0]);
+        return;
+    }
+
+    // Bursts take no schedule, so they go out before the timed streams start
+    ClickScheduler scheduler;
+    for (const ClickJob& job : request.streams) {
+        if (job.burst > 0) run_job(fd, job);
+    }
+    const int64_t start = monotonic_ns();
+    for (const ClickJob& job : request.streams) {
+        if (job.burst == 0) scheduler.add(job, start);
+    }
+    scheduler.run(fd);
+}
+
+// Event-loop driving for the scheduler: sends everything that is due,
+// then arms timer_fd (absolute CLOCK_MONOTONIC) for what is next, or
+// disarms it when idle. With high-frequency streams the timer fires one
+// spin window early and the rest is spun, as in wait_until.
+void dispatch_scheduled(ClickScheduler& scheduler, int device_fd, int timer_fd,
+                        vector<uint64_t>* finished = nullptr) {
+    const int64_t lead = scheduler.needs_spin() ? SPIN_WINDOW_NS : 0;
+    while (!scheduler.empty()) {
+        int64_t deadline = scheduler.wake_deadline();
+        if (deadline - lead > monotonic_ns()) break;
+        if (lead) spin_until(deadline);
+        scheduler.dispatch_due(device_fd, deadline, finished);
+    }
+
+    itimerspec timer = {};
+    if (!scheduler.empty()) {
+        int64_t wake = max<int64_t>(scheduler.wake_deadline() - lead, 1);
+        timer.it_value.tv_sec = wake / NS_PER_SEC;
+        timer.it_value.tv_nsec = wake % NS_PER_SEC;
+    }
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &timer, nullptr);
+}
+
+// The event loop of run_hotkey. The caller owns the descriptors and
+// releases held buttons however this returns.
+void run_hotkey_loop(int fd, const ClickRequest& request, int keyboard, int timer_fd, int epoll_fd,
+                     ClickScheduler& scheduler) {
+    bool clicking = false;
+    struct input_event events[64];
+    atomic<uint64_t>& wakeups = local_counters().wakeups;
+    while (!stopping()) {
+        epoll_event ready[3];
+        if (epoll_wait(epoll_fd, ready, 3, -1) < 0) {
+            if (errno == EINTR) continue;
+            throw runtime_error(string("epoll_wait failed: ") + strerror(errno));
+        }
+        count_add(wakeups);
+        uint64_t expirations;
+        while (read(timer_fd, &expirations, sizeof(expirations)) > 0) {}
+
+        ssize_t n;
+        while ((n = read(keyboard, events, sizeof(events))) > 0) {
+            for (size_t i = 0; i < n / sizeof(struct input_event); i++) {
+                const struct input_event& ie = events[i];
+                if (ie.type != EV_KEY || ie.code != request.hotkey || ie.value == 2) continue;  // Autorepeat
+
+                bool start = ie.value == 1 && !clicking;
+                bool stop = clicking && (request.toggle ? ie.value == 1 : ie.value == 0);
+                if (start) {
+                    const int64_t now = monotonic_ns();
+                    for (const ClickJob& job : request.streams) {
+                        if (job.burst > 0) {
+                            run_job(fd, job);
+                        } else {
+                            scheduler.add(job, now);
+                        }
+                    }
+                    dispatch_scheduled(scheduler, fd, timer_fd);
+                    clicking = true;
+                    if (debug_mode) {
+                        int64_t key_ns = ie.time.tv_sec * NS_PER_SEC + ie.time.tv_usec * NS_PER_US;
+                        cout << COLOR_YELLOW << "[DEBUG] Key down, first click " << (monotonic_ns() - key_ns) / 1000
+                             << "us after the key event" << COLOR_RESET << endl;
+                    }
+                } else if (stop) {
+                    scheduler.release_all(fd);
+                    clicking = false;
+                }
+            }
+        }
+        if (n < 0 && errno == ENODEV) throw runtime_error(request.hotkey_node + " went away");
+
+        dispatch_scheduled(scheduler, fd, timer_fd);
+        // Streams that ran out by -t or count wait for the next key press
+        if (clicking && scheduler.empty()) clicking = false;
+    }
+}
+
+// Clicks while a key on another input device is held, or from one press
+// to the next with --toggle. The key device, a timerfd at the next click
+// deadline and stop_event_fd all end the same epoll_wait, so a
+// key change reaches the virtual device within one pass of the loop.
+void run_hotkey(int fd, const ClickRequest& request) {
+    ScopedFd keyboard(open(request.hotkey_node.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC));
+    if (keyboard.fd < 0) {
+        throw runtime_error("Failed to open " + request.hotkey_node + ": " + strerror(errno));
+    }
+    int clock_id = CLOCK_MONOTONIC;  // Key stamps comparable with monotonic_ns()
+    ioctl(keyboard.fd, EVIOCSCLOCKID, &clock_id);
+
+    ScopedFd timer(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC));
+    ScopedFd epoll(epoll_create1(EPOLL_CLOEXEC));
+    auto watch = [&epoll](int source) {
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = source;
+        return epoll_ctl(epoll.fd, EPOLL_CTL_ADD, source, &event) == 0;
+    };
+    if (timer.fd < 0 || epoll.fd < 0 || !watch(keyboard.fd) || !watch(timer.fd) ||
+        (stop_event_fd >= 0 && !watch(stop_event_fd))) {
+        throw runtime_error(string("Failed to set up the hotkey loop: ") + strerror(errno));
+    }
+
+    cout << COLOR_BLUE << "[INFO] " << (request.toggle ? "Press" : "Hold") << " key code " << request.hotkey
+         << " on " << request.hotkey_node << " to click" << COLOR_RESET << endl;
+
+    ClickScheduler scheduler;
+    try {
+        run_hotkey_loop(fd, request, keyboard.fd, timer.fd, epoll.fd, scheduler);
+    } catch (...) {
+        scheduler.release_all(fd);  // Never leave a button down on the way out
+        throw;
+    }
+    scheduler.release_all(fd);
+}
+
+// Where scheduled frames go. submit() delivers the frame at
+// frame.deadline_ns; flush() returns once everything submitted is out.
+// After a stop signal, submit() and flush() return early and cancel()
+// drops whatever is still waiting for its deadline.
+class FrameSink {
+public:
+    virtual ~FrameSink() {}
+    virtual void submit(EventFrame& frame) = 0;
+    virtual void flush() {}
+    virtual void cancel() {}
+};
+
+// The plain backend: sleep (or spin) until the deadline, then write
+template <bool HighFrequency>
+class WriteSink : public FrameSink {
+public:
+    explicit WriteSink(int fd) : fd(fd) {}
+
+    void submit(EventFrame& frame) override {
+        wait_until<HighFrequency>(frame.deadline_ns);
+        if (stopping()) return;
+        send_frame(fd, frame);
+    }
+
+private:
+    int fd;
+};
+
+// io_uring backend. Each frame is a TIMEOUT on its absolute
+// CLOCK_MONOTONIC deadline linked to the WRITE of the frame, so the
+// kernel releases frames on schedule and this thread only wakes when the
+// window of URING_WINDOW queued frames needs refilling. Needs
+// IORING_TIMEOUT_ETIME_SUCCESS (Linux 5.16); open() fails on older
+// kernels and callers fall back to WriteSink. Completions are only seen
+// when reaped, well after the write, so these frames carry no lateness.
+class UringSink : public FrameSink {
+public:
+    ~UringSink() override {
+        if (ring_fd < 0) return;
+        munmap(sqes, params.sq_entries * sizeof(struct io_uring_sqe));
+        munmap(sq_ring, sq_ring_size);
+        munmap(cq_ring, cq_ring_size);
+        close(ring_fd);
+    }
+
+    bool open(int device_fd) {
+        fd = device_fd;
+        memset(&params, 0, sizeof(params));
+        ring_fd = syscall(__NR_io_uring_setup, 2 * URING_WINDOW, &params);
+        if (ring_fd < 0) return false;
+
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        sq_ring = (char*)mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                              ring_fd, IORING_OFF_SQ_RING);
+        cq_ring = (char*)mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                              ring_fd, IORING_OFF_CQ_RING);
+        sqes = (struct io_uring_sqe*)mmap(nullptr, params.sq_entries * sizeof(struct io_uring_sqe),
+                                          PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                          ring_fd, IORING_OFF_SQES);
+        if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+            // Leave nothing half-mapped for the destructor
+            if (sq_ring != MAP_FAILED) munmap(sq_ring, sq_ring_size);
+            if (cq_ring != MAP_FAILED) munmap(cq_ring, cq_ring_size);
+            if (sqes != MAP_FAILED) munmap(sqes, params.sq_entries * sizeof(struct io_uring_sqe));
+            close(ring_fd);
+            ring_fd = -1;
+            return false;
+        }
+
+        for (unsigned i = 0; i < URING_WINDOW; i++) free_slots[i] = URING_WINDOW - 1 - i;
+        free_count = URING_WINDOW;
+        return supports_linked_timeouts();
+    }
+
+    void submit(EventFrame& frame) override {
+        while (free_count == 0 && !stopping()) reap(1);
+        if (free_count == 0) return;
+
+        unsigned index = free_slots[--free_count];
+        Slot& slot = slots[index];
+        slot.frame = frame;
+        seal_frame(slot.frame, frame.deadline_ns);
+        slot.deadline.tv_sec = frame.deadline_ns / NS_PER_SEC;
+        slot.deadline.tv_nsec = frame.deadline_ns % NS_PER_SEC;
+
+        struct io_uring_sqe* timeout = next_sqe();
+        timeout->opcode = IORING_OP_TIMEOUT;
+        timeout->flags = IOSQE_IO_LINK;
+        timeout->fd = -1;
+        timeout->addr = (uint64_t)&slot.deadline;
+        timeout->len = 1;
+        timeout->timeout_flags = IORING_TIMEOUT_ABS | IORING_TIMEOUT_ETIME_SUCCESS;
+        timeout->user_data = index * 2;
+
+        struct io_uring_sqe* write = next_sqe();
+        write->opcode = IORING_OP_WRITE;
+        write->fd = fd;
+        write->addr = (uint64_t)slot.frame.events;
+        write->len = (slot.frame.count + 1) * sizeof(struct input_event);
+        write->off = (uint64_t)-1;
+        write->user_data = index * 2 + 1;
+
+        // Hand the kernel a full window at once rather than one frame per syscall
+        if (free_count == 0) reap(1);
+    }
+
+    void flush() override {
+        while ((free_count < URING_WINDOW || pending > 0) && !stopping()) {
+            reap(free_count < URING_WINDOW ? 1 : 0);
+        }
+    }
+
+    // Removes the timeout of every queued frame. That fails its linked
+    // write with ECANCELED, so nothing queued goes out after the stop.
+    void cancel() override {
+        reap(0);  // Submit first, the SQ ring only has room for the removals
+        bool queued[URING_WINDOW];
+        fill(queued, queued + URING_WINDOW, true);
+        for (unsigned i = 0; i < free_count; i++) queued[free_slots[i]] = false;
+
+        for (unsigned index = 0; index < URING_WINDOW; index++) {
+            if (!queued[index]) continue;
+            struct io_uring_sqe* remove = next_sqe();
+            remove->opcode = IORING_OP_TIMEOUT_REMOVE;
+            remove->fd = -1;
+            remove->addr = index * 2;
+            remove->user_data = URING_WINDOW * 2;  // Even, so reap() skips it like a timeout
+        }
+        while (free_count < URING_WINDOW || pending > 0) reap(free_count < URING_WINDOW ? 1 : 0);
+    }
+
+private:
+    struct Slot {
+        EventFrame frame;
+        struct __kernel_timespec deadline;
+    };
+
+    struct io_uring_sqe* next_sqe() {
+        unsigned* tail = (unsigned*)(sq_ring + params.sq_off.tail);
+        unsigned mask = *(unsigned*)(sq_ring + params.sq_off.ring_mask);
+        unsigned index = *tail & mask;
+        ((unsigned*)(sq_ring + params.sq_off.array))[index] = index;
+        memset(&sqes[index], 0, sizeof(struct io_uring_sqe));
+        __atomic_store_n(tail, *tail + 1, __ATOMIC_RELEASE);
+        pending++;
+        return &sqes[index];
+    }
+
+    // Submits queued SQEs and waits for at least min_complete completions
+    void reap(unsigned min_complete) {
+        for (;;) {
+            int n = syscall(__NR_io_uring_enter, ring_fd, pending, min_complete,
+                            min_complete ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if (n >= 0) {
+                pending -= n;
+                break;
+            }
+            if (errno != EINTR) throw runtime_error(string("io_uring_enter failed: ") + strerror(errno));
+            if (stopping()) break;  // Collect what has completed and let the caller stop
+        }
+
+        unsigned* head = (unsigned*)(cq_ring + params.cq_off.head);
+        unsigned tail = __atomic_load_n((unsigned*)(cq_ring + params.cq_off.tail), __ATOMIC_ACQUIRE);
+        unsigned mask = *(unsigned*)(cq_ring + params.cq_off.ring_mask);
+        struct io_uring_cqe* cqes = (struct io_uring_cqe*)(cq_ring + params.cq_off.cqes);
+
+        for (unsigned h = *head; h != tail; h++) {
+            const struct io_uring_cqe& cqe = cqes[h & mask];
+            if (cqe.user_data % 2 == 0) continue;  // The timeout half of the pair
+
+            unsigned index = cqe.user_data / 2;
+            if (cqe.res == -ECANCELED) {
+                // Pulled back by cancel()
+            } else if (cqe.res < 0) {
+                count_write_error(-cqe.res);
+                cerr << COLOR_RED << "[ERROR] Failed to send event: " << strerror(-cqe.res)
+                     << COLOR_RESET << endl;
+            } else if (debug_mode) {
+                account_frame<true>(slots[index].frame, 0);
+            } else {
+                account_frame<false>(slots[index].frame, 0);
+            }
+            free_slots[free_count++] = index;
+        }
+        __atomic_store_n(head, tail, __ATOMIC_RELEASE);
+    }
+
+    // Kernels before 5.16 reject IORING_TIMEOUT_ETIME_SUCCESS, which would
+    // cancel every linked write. Probe with an expired timeout + NOP.
+    bool supports_linked_timeouts() {
+        struct __kernel_timespec expired = {0, 0};
+        struct io_uring_sqe* timeout = next_sqe();
+        timeout->opcode = IORING_OP_TIMEOUT;
+        timeout->flags = IOSQE_IO_LINK;
+        timeout->fd = -1;
+        timeout->addr = (uint64_t)&expired;
+        timeout->len = 1;
+        timeout->timeout_flags = IORING_TIMEOUT_ABS | IORING_TIMEOUT_ETIME_SUCCESS;
+        struct io_uring_sqe* nop = next_sqe();
+        nop->opcode = IORING_OP_NOP;
+        nop->fd = -1;
+        nop->user_data = 1;
+
+        if (syscall(__NR_io_uring_enter, ring_fd, 2, 2, IORING_ENTER_GETEVENTS, nullptr, 0) != 2) return false;
+        pending = 0;
+
+        unsigned* head = (unsigned*)(cq_ring + params.cq_off.head);
+        unsigned tail = __atomic_load_n((unsigned*)(cq_ring + params.cq_off.tail), __ATOMIC_ACQUIRE);
+        unsigned mask = *(unsigned*)(cq_ring + params.cq_off.ring_mask);
+        struct io_uring_cqe* cqes = (struct io_uring_cqe*)(cq_ring + params.cq_off.cqes);
+        bool supported = false;
+        for (unsigned h = *head; h != tail; h++) {
+            if (cqes[h & mask].user_data == 1) supported = cqes[h & mask].res == 0;
+        }
+        __atomic_store_n(head, tail, __ATOMIC_RELEASE);
+        return supported;
+    }
+
+    int fd = -1;
+    int ring_fd = -1;
+    struct io_uring_params params;
+    char* sq_ring = nullptr;
+    char* cq_ring = nullptr;
+    size_t sq_ring_size = 0;
+    size_t cq_ring_size = 0;
+    struct io_uring_sqe* sqes = nullptr;
+    unsigned pending = 0;  // SQEs queued but not yet submitted
+
+    Slot slots[URING_WINDOW];
+    unsigned free_slots[URING_WINDOW];
+    unsigned free_count = 0;
+};
+
+// A read-only mapping of a timeline file
+struct Timeline {
+    const TimelineHeader* header = nullptr;
+    const TimelineRecord* records = nullptr;
+    size_t mapped_size = 0;
+
+    Timeline() = default;
+    Timeline(const Timeline&) = delete;
+    Timeline& operator=(const Timeline&) = delete;
+    ~Timeline() {
+        if (header) munmap((void*)header, mapped_size);
+    }
+};
+
+void map_timeline(const char* path, Timeline& timeline) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) throw runtime_error(string("Failed to open ") + path + ": " + strerror(errno));
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(TimelineHeader)) {
+        close(fd);
+        throw runtime_error(string("Not a timeline file: ") + path);
+    }
+
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) throw runtime_error(string("Failed to map ") + path + ": " + strerror(errno));
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    timeline.header = (const TimelineHeader*)data;
+    timeline.records = (const TimelineRecord*)(timeline.header + 1);
+    timeline.mapped_size = st.st_size;
+
+    const TimelineHeader& header = *timeline.header;
+    size_t max_records = (st.st_size - sizeof(TimelineHeader)) / sizeof(TimelineRecord);
+    if (memcmp(header.magic, TIMELINE_MAGIC, sizeof(TIMELINE_MAGIC)) != 0 ||
+        header.version != TIMELINE_VERSION || header.record_size != sizeof(TimelineRecord) ||
+        header.record_count > max_records) {
+        throw runtime_error(string("Not a timeline file or unsupported version: ") + path);
+    }
+}
+
+// Streams the records into the device on absolute deadlines measured
+// from one start time. Frames are assembled on the stack, so playback
+// does no allocation however long the timeline is.
+// Returns the keys a stop signal may have left held, empty when the
+// whole timeline was played
+vector<int> play_timeline(FrameSink& sink, const Timeline& timeline) {
+    const TimelineRecord* record = timeline.records;
+    const TimelineRecord* end = record + timeline.header->record_count;
+    const int64_t start = monotonic_ns();
+    int64_t offset_ns = 0;
+    atomic<uint64_t>& iterations = local_counters().loop_iterations;
+
+    EventFrame frame;
+    bitset<KEY_CNT> pressed;  // Every key pressed so far, released again on a stop
+    for (; record != end && !stopping(); ++record) {
+        offset_ns += record->delta_ns;
+        if (frame.count == 0) frame.deadline_ns = start + offset_ns;
+
+        bool syn = record->type == EV_SYN && record->code == SYN_REPORT;
+        if (!syn) frame.add(record->type, record->code, record->value);
+        if (record->type == EV_KEY && record->value == 1 && record->code < KEY_CNT) pressed.set(record->code);
+
+        // A frame ends at SYN_REPORT, when time moves on, or when it is full
+        bool frame_done = syn || record + 1 == end || record[1].delta_ns != 0 ||
+                          frame.count == MAX_FRAME_EVENTS - 1;
+        if (!frame_done) continue;
+        if (frame.count > 0) {
+            count_add(iterations);
+            sink.submit(frame);
+        }
+        frame.count = 0;
+    }
+    sink.flush();
+
+    vector<int> held;
+    if (stopping()) {
+        sink.cancel();
+        // Which queued frames made it out is unknown, but the kernel
+        // drops releases of keys that are not down
+        for (int code = 0; code < KEY_CNT; code++) {
+            if (pressed.test(code)) held.push_back(code);
+        }
+    }
+
+    if (debug_mode) {
+        cout << COLOR_YELLOW << "[DEBUG] Played " << record - timeline.records << " records in "
+             << format_duration((monotonic_ns() - start) / NS_PER_US * NS_PER_US) << COLOR_RESET << endl;
+    }
+    return held;
+}
+
+void release_keys(int fd, const vector<int>& codes) {
+    EventFrame frame;
+    for (int code : codes) {
+        if (frame.count == MAX_FRAME_EVENTS - 1) {
+            send_frame(fd, frame);
+            frame.count = 0;
+        }
+        frame.add(EV_KEY, code, 0);
+    }
+    if (frame.count > 0) send_frame(fd, frame);
+}
+
+// Writes a timeline file. Records are collected in fixed-size chunks and
+// a background thread writes full chunks, so the producer never waits on
+// disk I/O. The header is rewritten with the final counts in finish().
+struct TimelineWriter {
+    int fd = -1;
+    TimelineHeader header = {};
+    vector<TimelineRecord> current;
+
+    mutex queue_mutex;
+    condition_variable queue_cv;
+    deque<vector<TimelineRecord>> pending;  // Full chunks waiting for the writer
+    vector<vector<TimelineRecord>> spare;   // Written chunks, reused by append
+    bool closing = false;
+    int write_error = 0;
+    thread worker;
+
+    void open(const char* path) {
+        fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) throw runtime_error(string("Failed to create ") + path + ": " + strerror(errno));
+
+        memcpy(header.magic, TIMELINE_MAGIC, sizeof(TIMELINE_MAGIC));
+        header.version = TIMELINE_VERSION;
+        header.record_size = sizeof(TimelineRecord);
+        if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+            int err = errno ? errno : EIO;
+            close(fd);
+            fd = -1;
+            throw runtime_error(string("Failed to write ") + path + ": " + strerror(err));
+        }
+
+        current.reserve(RECORD_CHUNK_RECORDS);
+        worker = spawn_helper_thread([this] { write_chunks(); });
+    }
+
+    void append(uint64_t delta_ns, uint16_t type, uint16_t code, int32_t value) {
+        current.push_back({delta_ns, type, code, value});
+        header.record_count++;
+        header.duration_ns += delta_ns;
+        if (current.size() < RECORD_CHUNK_RECORDS) return;
+
+        lock_guard<mutex> lock(queue_mutex);
+        pending.push_back(move(current));
+        if (spare.empty()) {
+            current = vector<TimelineRecord>();
+            current.reserve(RECORD_CHUNK_RECORDS);
+        } else {
+            current = move(spare.back());
+            spare.pop_back();
+        }
+        queue_cv.notify_one();
+    }
+
+    void write_chunks() {
+        unique_lock<mutex> lock(queue_mutex);
+        for (;;) {
+            queue_cv.wait(lock, [this] { return closing || !pending.empty(); });
+            if (pending.empty()) return;
+
+            vector<TimelineRecord> chunk = move(pending.front());
+            pending.pop_front();
+            lock.unlock();
+            size_t size = chunk.size() * sizeof(TimelineRecord);
+            if (write(fd, chunk.data(), size) != (ssize_t)size && !write_error) write_error = errno ? errno : EIO;
+            chunk.clear();
+            lock.lock();
+            spare.push_back(move(chunk));
+        }
+    }
+
+    // Drains the queue and joins the worker; safe to call more than once
+    void stop_worker() {
+        if (!worker.joinable()) return;
+        {
+            lock_guard<mutex> lock(queue_mutex);
+            if (!current.empty()) pending.push_back(move(current));
+            closing = true;
+            queue_cv.notify_one();
+        }
+        worker.join();
+    }
+
+    // An exception between open() and finish() must not leave a
+    // joinable thread behind, that would terminate
+    ~TimelineWriter() {
+        stop_worker();
+        if (fd >= 0) close(fd);
+    }
+
+    void finish() {
+        stop_worker();
+
+        if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header) && !write_error) write_error = errno;
+        close(fd);
+        fd = -1;
+        if (write_error) throw runtime_error(string("Failed to write timeline: ") + strerror(write_error));
+    }
+};
+
+// Macro sources: a small text language compiled ahead of time into a
+// timeline, so playback streams precomputed frames and never parses.
+//   repeat 50 { l hold 30ms; wait 70ms }   r   wait 1s
+// Statements end at a newline or ';', '#' starts a comment. A bare
+// button is a click with the default hold; press, release, move and
+// wheel work as on --stdin.
+struct MacroNode {
+    enum Kind { FRAME, WAIT, REPEAT } kind = FRAME;
+    vector<input_event> events = {};  // FRAME: one instant, SYN_REPORT added on output
+    int64_t wait_ns = 0;              // WAIT
+    uint64_t times = 0;               // REPEAT
+    vector<MacroNode> body = {};      // REPEAT
+};
+
+// Already carries "<file>:<line>: "
+struct MacroError : invalid_argument {
+    using invalid_argument::invalid_argument;
+};
+
+struct MacroToken {
+    string text;
+    int line;
+};
+
+class MacroParser {
+public:
+    MacroParser(const string& source, const string& name) : name(name) {
+        int line = 1;
+        for (size_t i = 0; i < source.size();) {
+            char c = source[i];
+            if (c == '#') {
+                while (i < source.size() && source[i] != '\n') i++;
+            } else if (c == '\n' || c == ';' || c == '{' || c == '}') {
+                tokens.push_back({string(1, c == '\n' ? ';' : c), line});
+                if (c == '\n') line++;
+                i++;
+            } else if (isspace((unsigned char)c)) {
+                i++;
+            } else {
+                size_t start = i;
+                while (i < source.size() && !isspace((unsigned char)source[i]) &&
+                       !strchr("#;{}", source[i])) i++;
+                tokens.push_back({source.substr(start, i - start), line});
+            }
+        }
+    }
+
+    vector<MacroNode> parse() {
+        size_t pos = 0;
+        return parse_block(pos, 0);
+    }
+
+private:
+    [[noreturn]] void fail(int line, const string& message) const {
+        throw MacroError(name + ":" + to_string(line) + ": " + message);
+    }
+
+    vector<MacroNode> parse_block(size_t& pos, int depth) {
+        vector<MacroNode> nodes;
+        for (;;) {
+            while (pos < tokens.size() && tokens[pos].text == ";") pos++;
+            if (pos == tokens.size()) {
+                if (depth > 0) fail(tokens.back().line, "Missing }");
+                return nodes;
+            }
+            if (tokens[pos].text == "}") {
+                if (depth == 0) fail(tokens[pos].line, "Unexpected }");
+                pos++;
+                return nodes;
+            }
+
+            const int line = tokens[pos].line;
+            vector<string> words;
+            while (pos < tokens.size() && tokens[pos].text != ";" && tokens[pos].text != "{" &&
+                   tokens[pos].text != "}") {
+                words.push_back(tokens[pos++].text);
+            }
+            if (words.empty()) fail(line, "Unexpected {");
+            try {
+                parse_statement(words, line, pos, depth, nodes);
+            } catch (const MacroError&) {
+                throw;
+            } catch (const invalid_argument& e) {
+                fail(line, e.what());  // parse_int and parse_duration know no lines
+            }
+        }
+    }
+
+    void parse_statement(vector<string>& words, int line, size_t& pos, int depth, vector<MacroNode>& nodes) {
+        const string& command = words[0];
+        auto button = [&](const string& word) {
+            int code = word.size() == 1 ? lookup_button(word[0]) : -1;
+            if (code < 0) fail(line, "Not a button: " + word + " (l, r, m, s, e, f, b)");
+            return code;
+        };
+        auto frame = [&](uint16_t type, uint16_t code, int32_t value) {
+            MacroNode node{MacroNode::FRAME};
+            input_event event = {};
+            event.type = type;
+            event.code = code;
+            event.value = value;
+            node.events.push_back(event);
+            nodes.push_back(node);
+        };
+        auto wait = [&](int64_t ns) {
+            MacroNode node{MacroNode::WAIT};
+            node.wait_ns = ns;
+            nodes.push_back(node);
+        };
+        auto arity = [&](size_t count) {
+            if (words.size() != count + 1) fail(line, command + " takes " + to_string(count) + " argument(s)");
+        };
+
+        if (command == "repeat") {
+            arity(1);
+            string count = words[1];
+            for (const char* suffix : {"x", "\xc3\x97"}) {  // "50x" or "50×"
+                size_t length = strlen(suffix);
+                if (count.size() > length && count.compare(count.size() - length, length, suffix) == 0) {
+                    count.erase(count.size() - length);
+                }
+            }
+            if (pos == tokens.size() || tokens[pos].text != "{") fail(line, "repeat needs a { block }");
+            if (depth + 1 > MAX_MACRO_DEPTH) fail(line, "Blocks nested too deep");
+            MacroNode node{MacroNode::REPEAT};
+            node.times = parse_int(count.c_str(), 0, INT32_MAX);
+            pos++;
+            node.body = parse_block(pos, depth + 1);
+            nodes.push_back(move(node));
+        } else if (command == "wait") {
+            arity(1);
+            wait(parse_duration(words[1].c_str()));
+        } else if (command == "press" || command == "release") {
+            arity(1);
+            frame(EV_KEY, button(words[1]), command == "press");
+        } else if (command == "move") {
+            arity(2);
+            MacroNode node{MacroNode::FRAME};
+            for (int axis = 0; axis < 2; axis++) {
+                input_event event = {};
+                event.type = EV_REL;
+                event.code = axis ? REL_Y : REL_X;
+                event.value = parse_int(words[1 + axis].c_str(), INT32_MIN, INT32_MAX);
+                node.events.push_back(event);
+            }
+            nodes.push_back(node);
+        } else if (command == "wheel") {
+            arity(1);
+            frame(EV_REL, REL_WHEEL, parse_int(words[1].c_str(), -127, 127));
+        } else if (command.size() == 1) {
+            int code = button(command);
+            int64_t hold_ns = DEFAULT_HOLD_MS * NS_PER_MS;
+            if (words.size() == 3 && words[1] == "hold") {
+                hold_ns = parse_duration(words[2].c_str());
+            } else if (words.size() != 1) {
+                fail(line, "A click takes only 'hold <t>'");
+            }
+            frame(EV_KEY, code, 1);
+            wait(hold_ns);
+            frame(EV_KEY, code, 0);
+        } else {
+            fail(line, "Unknown command: " + command);
+        }
+    }
+
+    string name;
+    vector<MacroToken> tokens;
+};
+
+// Records the nodes expand to, saturating at MAX_MACRO_RECORDS + 1
+uint64_t count_macro_records(const vector<MacroNode>& nodes) {
+    uint64_t total = 0;
+    for (const MacroNode& node : nodes) {
+        uint64_t n = node.kind == MacroNode::FRAME ? node.events.size() + 1
+                   : node.kind == MacroNode::REPEAT ? count_macro_records(node.body) : 0;
+        if (node.kind == MacroNode::REPEAT && n && node.times > MAX_MACRO_RECORDS / n) n = MAX_MACRO_RECORDS + 1;
+        else if (node.kind == MacroNode::REPEAT) n *= node.times;
+        total = min(total + n, MAX_MACRO_RECORDS + 1);
+    }
+    return total;
+}
+
+// Expands loops straight into the writer, so even a huge repeat costs no
+// memory. `pending_ns` carries waits to the next frame's delta.
+void emit_macro(const vector<MacroNode>& nodes, TimelineWriter& writer, uint64_t& pending_ns) {
+    for (const MacroNode& node : nodes) {
+        switch (node.kind) {
+        case MacroNode::FRAME:
+            for (const input_event& event : node.events) {
+                writer.append(pending_ns, event.type, event.code, event.value);
+                pending_ns = 0;
+            }
+            writer.append(0, EV_SYN, SYN_REPORT, 0);
+            break;
+        case MacroNode::WAIT:
+            pending_ns += node.wait_ns;
+            break;
+        case MacroNode::REPEAT:
+            for (uint64_t i = 0; i < node.times; i++) emit_macro(node.body, writer, pending_ns);
+            break;
+        }
+    }
+}
+
+void compile_macro(const string& source, const string& name, const string& out_path) {
+    vector<MacroNode> program = MacroParser(source, name).parse();
+    if (count_macro_records(program) > MAX_MACRO_RECORDS) {
+        throw invalid_argument(name + ": expands to more than " + to_string(MAX_MACRO_RECORDS) + " records");
+    }
+
+    // Written under a temporary name and renamed, so a cache entry is
+    // never seen half-written
+    const string temp_path = out_path + "." + to_string(getpid()) + ".tmp";
+    TimelineWriter writer;
+    writer.open(temp_path.c_str());
+    uint64_t pending_ns = 0;
+    emit_macro(program, writer, pending_ns);
+    // A trailing wait stays in the duration as a bare SYN_REPORT
+    if (pending_ns) writer.append(pending_ns, EV_SYN, SYN_REPORT, 0);
+    const TimelineHeader header = writer.header;
+    try {
+        writer.finish();
+    } catch (...) {
+        unlink(temp_path.c_str());
+        throw;
+    }
+    if (rename(temp_path.c_str(), out_path.c_str()) < 0) {
+        int err = errno;
+        unlink(temp_path.c_str());
+        throw runtime_error("Failed to write " + out_path + ": " + strerror(err));
+    }
+    if (debug_mode) {
+        cout << COLOR_YELLOW << "[DEBUG] Compiled " << name << ": " << header.record_count << " records, "
+             << format_duration(header.duration_ns) << COLOR_RESET << endl;
+    }
+}
+
+string read_file(const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) throw runtime_error(string("Failed to open ") + path + ": " + strerror(errno));
+    string data;
+    char buffer[65536];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) data.append(buffer, n);
+    int err = errno;
+    close(fd);
+    if (n < 0) throw runtime_error(string("Failed to read ") + path + ": " + strerror(err));
+    return data;
+}
+
+uint64_t fnv1a_64(const void* data, size_t size, uint64_t hash = 0xcbf29ce484222325ULL) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; i++) hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    return hash;
+}
+
+// $XDG_CACHE_HOME/mclick, else ~/.cache/mclick, created on demand
+string macro_cache_dir() {
+    const char* xdg = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    if ((!xdg || !*xdg) && (!home || !*home)) throw runtime_error("Neither XDG_CACHE_HOME nor HOME is set");
+    string base = xdg && *xdg ? xdg : string(home) + "/.cache";
+    mkdir(base.c_str(), 0755);
+    string dir = base + "/mclick";
+    if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) {
+        throw runtime_error("Failed to create " + dir + ": " + strerror(errno));
+    }
+    return dir;
+}
+
+// The compiled timeline for a macro, keyed by an FNV-1a hash of its text
+// and the compiler and format versions. Unchanged macros skip compiling.
+string compile_macro_cached(const char* path) {
+    const string source = read_file(path);
+    const uint32_t versions[2] = {MACRO_COMPILER_VERSION, TIMELINE_VERSION};
+    uint64_t hash = fnv1a_64(source.data(), source.size(), fnv1a_64(versions, sizeof(versions)));
+    char key[17];
+    snprintf(key, sizeof(key), "%016llx", (unsigned long long)hash);
+    const string cached = macro_cache_dir() + "/" + key + ".tl";
+
+    if (access(cached.c_str(), R_OK) == 0) {
+        if (debug_mode) cout << COLOR_YELLOW << "[DEBUG] " << path << ": cached " << cached << COLOR_RESET << endl;
+        return cached;
+    }
+    compile_macro(source, path, cached);
+    return cached;
+}
+
+bool is_timeline_file(const char* path) {
+    char magic[sizeof(TIMELINE_MAGIC)];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    bool matches = read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+                   memcmp(magic, TIMELINE_MAGIC, sizeof(magic)) == 0;
+    close(fd);
+    return matches;
+}
+
+// play takes timelines as they are and macros through the cache
+string resolve_timeline(const char* path) {
+    if (access(path, R_OK) < 0 || is_timeline_file(path)) return path;
+    return compile_macro_cached(path);
+}
+
+// mclick compile <macro> [-o out.tl]: without -o the result goes to the
+// cache, and its path is printed
+int run_compile(int argc, char* argv[]) {
+    if (argc < 3) throw invalid_argument("Usage: mclick compile <macro> [-o <timeline>]");
+    const char* out_path = nullptr;
+    for (int i = 3; i < argc; i++) {
+        string arg = argv[i];
+        if ((arg == "-o" || arg == "--output") && i + 1 < argc) {
+            out_path = argv[++i];
+        } else if (arg != "-d" && arg != "--debug") {
+            throw invalid_argument("Unknown compile option: " + arg);
+        }
+    }
+
+    if (out_path) {
+        compile_macro(read_file(argv[2]), argv[2], out_path);
+        cout << out_path << '\n';
+    } else {
+        cout << compile_macro_cached(argv[2]) << '\n';
+    }
+    return EXIT_SUCCESS;
+}
+
+int run_play(int argc, char* argv[]) {
+    if (argc < 3) throw invalid_argument("Usage: mclick play <file|macro> [-hf] [--backend write|uring] [-d]");
+
+    bool high_frequency = false;
+    bool use_uring = false;
+    for (int i = 3; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "-hf" || arg == "--high-frequency") {
+            if (efficient_mode) throw invalid_argument("-hf spins, which --efficient never does");
+            high_frequency = true;
+        } else if (arg == "--backend" && i + 1 < argc) {
+            string backend = argv[++i];
+            if (backend != "write" && backend != "uring") throw invalid_argument("Unknown backend: " + backend);
+            use_uring = backend == "uring";
+        } else if (global_option_arity(arg) >= 0) {
+            i += global_option_arity(arg); // Consumed by main
+        } else if (arg != "-d" && arg != "--debug") {
+            throw invalid_argument("Unknown play option: " + arg);
+        }
+    }
+
+    Timeline timeline;
+    map_timeline(resolve_timeline(argv[2]).c_str(), timeline);
+
+    install_stop_handler();
+    UinputDevice device;
+    const int fd = device.fd;
+    apply_scheduling_profile();
+
+    unique_ptr<FrameSink> sink;
+    if (use_uring) {
+        unique_ptr<UringSink> uring(new UringSink());
+        if (uring->open(fd)) {
+            sink = move(uring);
+        } else {
+            cerr << COLOR_YELLOW << "[WARN] io_uring with linked timeouts unavailable, using write()"
+                 << COLOR_RESET << endl;
+        }
+    }
+    if (!sink && high_frequency) sink.reset(new WriteSink<true>(fd));
+    if (!sink) sink.reset(new WriteSink<false>(fd));
+
+    vector<int> held = play_timeline(*sink, timeline);
+    sink.reset();
+    release_keys(fd, held);
+    return stopping() ? 128 + stop_signal : EXIT_SUCCESS;
+}
+
+bool is_mouse_button(uint16_t code) {
+    return code >= BTN_MOUSE && code <= BTN_TASK;
+}
+
+bool is_pointer_axis(uint16_t code) {
+    for (int axis : REL_AXES) {
+        if (axis == code) return true;
+    }
+    return false;
+}
+
+// Captures button events from a real evdev device into a timeline. Reads
+// are batched and use kernel CLOCK_MONOTONIC stamps, so the recorded
+// timing is exact however late this process gets scheduled.
+int run_record(int argc, char* argv[]) {
+    if (argc < 4) throw invalid_argument("Usage: mclick record <evdev-node> <timeline> [-b <buttons>] [-t <time>] [--motion]");
+
+    vector<bool> wanted(KEY_CNT, false);
+    for (uint16_t code = BTN_MOUSE; code <= BTN_TASK; code++) wanted[code] = true;
+    int64_t duration_ns = 0;
+    bool motion = false;
+
+    for (int i = 4; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--motion") {
+            motion = true;
+        } else if ((arg == "-b" || arg == "--buttons") && i + 1 < argc) {
+            fill(wanted.begin(), wanted.end(), false);
+            for (const char* name = argv[++i]; *name; name++) {
+                int code = lookup_button(*name);
+                if (code < 0) throw invalid_argument(string("Invalid button: ") + *name);
+                wanted[code] = true;
+            }
+        } else if ((arg == "-t" || arg == "--time") && i + 1 < argc) {
+            duration_ns = parse_duration(argv[++i]);
+        } else if (global_option_arity(arg) >= 0) {
+            i += global_option_arity(arg); // Consumed by main
+        } else if (arg != "-d" && arg != "--debug") {
+            throw invalid_argument("Unknown record option: " + arg);
+        }
+    }
+
+    int input = open(argv[2], O_RDONLY | O_CLOEXEC);
+    if (input < 0) throw runtime_error(string("Failed to open ") + argv[2] + ": " + strerror(errno));
+    int clock_id = CLOCK_MONOTONIC;
+    if (ioctl(input, EVIOCSCLOCKID, &clock_id) < 0) {
+        cerr << COLOR_YELLOW << "[WARN] Device keeps realtime timestamps: " << strerror(errno) << COLOR_RESET << endl;
+    }
+
+    TimelineWriter writer;
+    writer.open(argv[3]);
+    install_stop_handler();
+    cout << COLOR_BLUE << "[INFO] Recording " << argv[2] << ", press Ctrl+C to stop" << COLOR_RESET << endl;
+
+    const int64_t end = duration_ns ? monotonic_ns() + duration_ns : 0;
+    struct input_event events[RECORD_READ_EVENTS];
+    int64_t last_ns = -1;      // Timestamp of the last kept record
+    bool frame_open = false;   // A kept event is waiting for its SYN_REPORT
+    uint64_t dropped = 0;
+
+    while (!stop_requested.load(memory_order_relaxed)) {
+        int timeout_ms = -1;
+        if (end) {
+            int64_t remaining = end - monotonic_ns();
+            if (remaining <= 0) break;
+            timeout_ms = (remaining + NS_PER_MS - 1) / NS_PER_MS;
+        }
+        if (poll_or_stop(input, POLLIN, timeout_ms) <= 0) continue;
+
+        ssize_t n = read(input, events, sizeof(events));
+        // An unplugged device fails with ENODEV; keep what was recorded
+        if (n == 0 || (n < 0 && errno == ENODEV)) {
+            cerr << COLOR_YELLOW << "[WARN] " << argv[2] << " went away, recording stopped" << COLOR_RESET << endl;
+            break;
+        }
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            throw runtime_error(string("Failed to read ") + argv[2] + ": " + strerror(errno));
+        }
+
+        for (size_t i = 0; i < n / sizeof(struct input_event); i++) {
+            const struct input_event& ie = events[i];
+            bool keep = (ie.type == EV_KEY && ie.code < KEY_CNT && wanted[ie.code] && ie.value != 2) ||
+                        (motion && ie.type == EV_REL && is_pointer_axis(ie.code));
+            bool syn = ie.type == EV_SYN && ie.code == SYN_REPORT;
+            if (ie.type == EV_SYN && ie.code == SYN_DROPPED) dropped++;
+            if (!keep && !(syn && frame_open)) continue;
+
+            int64_t t = ie.time.tv_sec * NS_PER_SEC + ie.time.tv_usec * NS_PER_US;
+            writer.append(last_ns < 0 ? 0 : t - last_ns, ie.type, ie.code, ie.value);
+            last_ns = t;
+            frame_open = keep;
+        }
+    }
+    close(input);
+    writer.finish();
+
+    if (dropped) {
+        cerr << COLOR_YELLOW << "[WARN] Kernel dropped events " << dropped << " times" << COLOR_RESET << endl;
+    }
+    cout << COLOR_BLUE << "[INFO] Recorded " << writer.header.record_count << " records ("
+         << format_duration(writer.header.duration_ns / NS_PER_MS * NS_PER_MS) << ") to " << argv[3]
+         << COLOR_RESET << endl;
+    return EXIT_SUCCESS;
+}
+
+// shm_open wants a leading slash, users type the bare name
+string control_path(const string& name) {
+    return name[0] == '/' ? name : "/" + name;
+}
+
+// Owner pid of an existing control block, 0 when it has none or the
+// owner is gone
+pid_t control_block_owner(const string& path) {
+    int fd = shm_open(path.c_str(), O_RDONLY, 0);
+    if (fd < 0) return 0;
+    struct stat st;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(ControlBlock)) {
+        data = mmap(nullptr, sizeof(ControlBlock), PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) return 0;
+
+    const ControlBlock* block = (const ControlBlock*)data;
+    pid_t pid = memcmp(block->magic, CONTROL_MAGIC, sizeof(CONTROL_MAGIC)) == 0 ? block->pid : 0;
+    munmap(data, sizeof(ControlBlock));
+    if (pid <= 0 || pid == getpid()) return 0;
+    return kill(pid, 0) == 0 || errno == EPERM ? pid : 0;
+}
+
+// Creates (owner) or maps an existing (ctl) control block
+ControlBlock* map_control_block(const string& name, bool create) {
+    const string path = control_path(name);
+    int fd = shm_open(path.c_str(), create ? O_RDWR | O_CREAT | O_EXCL : O_RDWR, 0600);
+    if (fd < 0 && create && errno == EEXIST) {
+        // Only a block left behind by a run that was killed is taken over
+        if (pid_t owner = control_block_owner(path)) {
+            throw runtime_error("Control block in use: " + path + " belongs to pid " + to_string(owner));
+        }
+        shm_unlink(path.c_str());
+        fd = shm_open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    }
+    if (fd < 0) throw runtime_error("Failed to open shared memory " + path + ": " + strerror(errno));
+
+    struct stat st;
+    if ((create && ftruncate(fd, sizeof(ControlBlock)) < 0) || fstat(fd, &st) < 0 ||
+        (size_t)st.st_size < sizeof(ControlBlock)) {
+        close(fd);
+        throw runtime_error("Not a control block: " + path);
+    }
+    void* data = mmap(nullptr, sizeof(ControlBlock), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) throw runtime_error(string("Failed to map control block: ") + strerror(errno));
+
+    ControlBlock* block = (ControlBlock*)data;
+    if (create) {
+        block->pid = getpid();
+        memcpy(block->magic, CONTROL_MAGIC, sizeof(CONTROL_MAGIC));
+    } else if (memcmp(block->magic, CONTROL_MAGIC, sizeof(CONTROL_MAGIC)) != 0) {
+        munmap(data, sizeof(ControlBlock));
+        throw runtime_error("Not a control block: " + path);
+    }
+    return block;
+}
+
+// mclick ctl <name> [-h <t>] [-cs <t>] [--cps <n>] [pause|resume|stop]
+// Without changes it prints the block.
+int run_ctl(int argc, char* argv[]) {
+    if (argc < 3) {
+        throw invalid_argument("Usage: mclick ctl <name> [-h <t>] [-cs <t>] [--cps <n>] [pause|resume|stop]");
+    }
+    ControlBlock& block = *map_control_block(argv[2], false);
+
+    // Timings parse like a click so -h, -cs, --cps and --duty mean the same here
+    static char program_name[] = "mclick", button[] = "l";
+    vector<char*> timing_args = {program_name, button};
+    // Only the fields named here are stored, the parser's defaults for the
+    // rest would otherwise reset the live values
+    bool set_hold = false, set_speed = false;
+    for (int i = 3; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "pause" || arg == "resume") {
+            block.paused.store(arg == "pause", memory_order_relaxed);
+        } else if (arg == "stop") {
+            block.stop.store(1, memory_order_relaxed);
+        } else if (global_option_arity(arg) >= 0) {
+            i += global_option_arity(arg);
+        } else {
+            timing_args.push_back(argv[i]);
+            note_timing_option(arg, set_hold, set_speed);
+        }
+    }
+    if (timing_args.size() > 2) {
+        ClickJob job = parse_click_args(timing_args.size(), timing_args.data()).streams[0];
+        if (set_hold) block.hold_ns.store(job.hold_ns, memory_order_relaxed);
+        if (set_speed) block.click_speed_ns.store(job.click_speed_ns, memory_order_relaxed);
+    }
+    if (argc > 3) return EXIT_SUCCESS;
+
+    const uint64_t clicks = block.clicks.load(memory_order_relaxed);
+    const int64_t running = monotonic_ns() - block.started_ns.load(memory_order_relaxed);
+    cout << "pid " << block.pid << '\n'
+         << "hold " << format_duration(block.hold_ns.load(memory_order_relaxed)) << '\n'
+         << "speed " << format_duration(block.click_speed_ns.load(memory_order_relaxed)) << '\n'
+         << "paused " << (block.paused.load(memory_order_relaxed) ? "yes" : "no") << '\n'
+         << "clicks " << clicks << '\n'
+         << "average_cps " << fixed << setprecision(3) << (running > 0 ? clicks * double(NS_PER_SEC) / running : 0)
+         << '\n';
+    return EXIT_SUCCESS;
+}
+
+// One --stdin line, tokenized in place. Primitives write one frame each
+// and never allocate; `wait` and click holds advance `clock`, a script
+// clock of absolute deadlines, so "click l; wait 10ms" repeated keeps an
+// exact 10ms grid. A wait that is already over when it is read (the pipe
+// was idle) restarts the clock from now instead of bursting to catch up.
+// Returns false for blank and comment lines.
+bool run_stdin_command(int fd, char* line, int64_t& clock, bitset<KEY_CNT>& held) {
+    char* tokens[MAX_STDIN_TOKENS];
+    int count = 0;
+    for (char* p = line; *p && count < MAX_STDIN_TOKENS;) {
+        while (*p == ' ' || *p == '\t' || *p == '\r') p++;
+        if (!*p) break;
+        tokens[count++] = p;
+        while (*p && *p != ' ' && *p != '\t' && *p != '\r') p++;
+        if (*p) *p++ = '\0';
+    }
+    if (count == 0 || tokens[0][0] == '#') return false;
+
+    const char* command = tokens[0];
+    auto button_arg = [&]() {
+        int code = count > 1 && !tokens[1][1] ? lookup_button(tokens[1][0]) : -1;
+        if (code < 0) throw invalid_argument(string(command) + " needs a button (l, r, m, s, e, f, b)");
+        return code;
+    };
+    auto wait = [&](int64_t duration_ns) {
+        clock = max(clock + duration_ns, monotonic_ns());
+        sleep_until(clock);
+    };
+    auto send_key = [&](int code, int value) {
+        EventFrame frame;
+        frame.add(EV_KEY, code, value);
+        send_frame(fd, frame);
+        held.set(code, value);
+    };
+
+    if (!strcmp(command, "press") || !strcmp(command, "release")) {
+        send_key(button_arg(), command[0] == 'p');
+    } else if (!strcmp(command, "click")) {
+        int code = button_arg();
+        send_key(code, 1);
+        wait(count > 2 ? parse_duration(tokens[2]) : DEFAULT_HOLD_MS * NS_PER_MS);  // As a bare macro button
+        send_key(code, 0);
+    } else if (!strcmp(command, "wait")) {
+        if (count < 2) throw invalid_argument("wait needs a duration");
+        wait(parse_duration(tokens[1]));
+    } else if (!strcmp(command, "move") || !strcmp(command, "wheel")) {
+        EventFrame frame;
+        if (command[0] == 'm') {
+            if (count < 3) throw invalid_argument("move needs dx and dy");
+            frame.add(EV_REL, REL_X, parse_int(tokens[1], INT32_MIN, INT32_MAX));
+            frame.add(EV_REL, REL_Y, parse_int(tokens[2], INT32_MIN, INT32_MAX));
+        } else {
+            if (count < 2) throw invalid_argument("wheel needs a number of detents");
+            frame.add(EV_REL, REL_WHEEL, parse_int(tokens[1], -127, 127));
+        }
+        send_frame(fd, frame);
+    } else if (!command[1] && lookup_button(command[0]) >= 0) {
+        // A whole job as on the command line; this path may allocate
+        static char program_name[] = "mclick";
+        vector<char*> args = {program_name};
+        args.insert(args.end(), tokens, tokens + count);
+        ClickRequest request = parse_click_args(args.size(), args.data());
+        if (request.hotkey >= 0 || !request.shm_name.empty() || request.device >= 0) {
+            throw invalid_argument("--hotkey, --shm and --device are not available on stdin");
+        }
+        run_request(fd, request);
+        clock = max(clock, monotonic_ns());
+    } else {
+        throw invalid_argument(string("Unknown command: ") + command);
+    }
+    return true;
+}
 
-    // Validate ioctl operations
-    if (ioctl(fd, UI_SET_EVBIT, EV_KEY) < 0 ||
-        ioctl(fd, UI_SET_KEYBIT, BTN_LEFT) < 0 ||
-        ioctl(fd, UI_SET_KEYBIT, BTN_RIGHT) < 0) {
-        cerr << COLOR_RED << "[ERROR] Failed to set device capabilities" << COLOR_RESET << endl;
-        close(fd);
-        exit(EXIT_FAILURE);
-    }
+// mclick --stdin: executes a line-oriented command stream from a pipe on
+// one persistent device. Reads are STDIN_BUFFER_SIZE at a time and lines
+// are cut out of the buffer in place; only the unfinished tail is moved.
+int run_stdin(int fd) {
+    vector<char> buffer(STDIN_BUFFER_SIZE + 1);  // +1 for the terminator of a last unterminated line
+    size_t filled = 0;
+    uint64_t line_number = 0, commands = 0, errors = 0;
+    bool skipping = false;  // Inside a line too long for the buffer
+    bitset<KEY_CNT> held;
+    int64_t clock = monotonic_ns();
+    const int64_t start = clock;
 
-    struct uinput_user_dev dev = {0};
-    snprintf(dev.name, UINPUT_MAX_NAME_SIZE, "virtual-mouse");
-    dev.id.bustype = BUS_USB;
-    dev.id.vendor = 0x1234;
-    dev.id.product = 0x5678;
-    dev.id.version = 1;
+    auto execute = [&](char* line) {
+        line_number++;
+        try {
+            if (run_stdin_command(fd, line, clock, held)) commands++;
+        } catch (const exception& e) {
+            errors++;
+            cerr << COLOR_RED << "[ERROR] stdin:" << line_number << ": " << e.what() << COLOR_RESET << endl;
+        }
+    };
 
-    if (write(fd, &dev, sizeof(dev)) != sizeof(dev)) {
-        cerr << COLOR_RED 
-             << "[ERROR] Failed to write device info: " << strerror(errno)
-             << COLOR_RESET << endl;
-        close(fd);
-        exit(EXIT_FAILURE);
+    while (!stopping()) {
+        ssize_t n = read(STDIN_FILENO, buffer.data() + filled, STDIN_BUFFER_SIZE - filled);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw runtime_error(string("Failed to read stdin: ") + strerror(errno));
+        }
+        if (n == 0) {
+            if (filled > 0 && !skipping) {
+                buffer[filled] = '\0';
+                execute(buffer.data());
+            }
+            break;
+        }
+        filled += n;
+
+        char* line = buffer.data();
+        char* end = line + filled;
+        char* newline;
+        while (!stopping() && (newline = (char*)memchr(line, '\n', end - line))) {
+            *newline = '\0';
+            if (skipping) {
+                skipping = false;
+            } else {
+                execute(line);
+            }
+            line = newline + 1;
+        }
+        filled = end - line;
+        if (filled == STDIN_BUFFER_SIZE) {
+            cerr << COLOR_RED << "[ERROR] stdin:" << ++line_number << ": Line too long" << COLOR_RESET << endl;
+            errors++;
+            skipping = true;
+            filled = 0;
+        }
+        memmove(buffer.data(), line, filled);
     }
 
-    if (ioctl(fd, UI_DEV_CREATE) < 0) {
-        cerr << COLOR_RED 
-             << "[ERROR] Failed to create device: " << strerror(errno)
-             << COLOR_RESET << endl;
-        close(fd);
-        exit(EXIT_FAILURE);
+    vector<int> pressed;
+    for (int code = 0; code < KEY_CNT; code++) {
+        if (held.test(code)) pressed.push_back(code);
     }
+    release_keys(fd, pressed);
 
-    return fd;
+    const int64_t elapsed = max<int64_t>(monotonic_ns() - start, 1);
+    cerr << COLOR_BLUE << "[INFO] stdin: " << commands << " commands, " << errors << " errors in "
+         << fixed << setprecision(1) << elapsed / double(NS_PER_MS) << "ms (" << setprecision(0)
+         << commands * double(NS_PER_SEC) / elapsed << " commands/s)" << COLOR_RESET << endl;
+    return stopping() ? 128 + stop_signal : errors ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
-void send_input_event(int fd, uint16_t type, uint16_t code, int32_t value) {
-    struct input_event ie;
-    memset(&ie, 0, sizeof(ie));
-    gettimeofday(&ie.time, NULL);
-    ie.type = type;
-    ie.code = code;
-    ie.value = value;
+// Splits a request line into an argv-style vector. argv[0] is a dummy
+// program name so the result can go straight to parse_click_args.
+vector<char*> split_request(char* line) {
+    static char program_name[] = "mclick";
+    vector<char*> args = {program_name};
+    for (char* token = strtok(line, " \t\r\n"); token; token = strtok(nullptr, " \t\r\n")) {
+        args.push_back(token);
+    }
+    return args;
+}
 
-    if (write(fd, &ie, sizeof(ie)) < 0) {
-        cerr << COLOR_RED 
-             << "[ERROR] Failed to send event: " << strerror(errno)
-             << COLOR_RESET << endl;
-        return;
+int bind_control_socket(const char* socket_path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        throw invalid_argument(string("Socket path too long: ") + socket_path);
     }
+    strcpy(addr.sun_path, socket_path);
 
-    if (debug_mode && type == EV_KEY) {
-        auto now = chrono::system_clock::now();
-        time_t time_point = chrono::system_clock::to_time_t(now);
-        auto ms = chrono::duration_cast<chrono::milliseconds>(
-            now.time_since_epoch() % chrono::seconds(1));
-        
-        cout << COLOR_YELLOW << "[DEBUG] " << COLOR_GREEN
-             << put_time(localtime(&time_point), "%H:%M:%S:") << ms.count()
-             << " " << (value ? "Press" : "Release") << " code=" << code
-             << COLOR_RESET << endl;
+    int server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server < 0) {
+        throw runtime_error(string("Failed to create socket: ") + strerror(errno));
     }
-}
 
-void send_event(int fd, int button, int action) {
-    send_input_event(fd, EV_KEY, button, action);
-    send_input_event(fd, EV_SYN, SYN_REPORT, 0);
+    unlink(socket_path);
+    if (bind(server, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(server, 16) < 0) {
+        int err = errno;
+        close(server);
+        throw runtime_error(string("Failed to bind ") + socket_path + ": " + strerror(err));
+    }
+    return server;
 }
 
-void sleep_ms(int ms) {
-    this_thread::sleep_for(chrono::milliseconds(ms));
+// Takes the next newline-terminated line out of `pending`, reading more
+// from the socket as needed. Returns false on EOF, errors or overflow.
+bool read_line(int sock, string& pending, string& line) {
+    char buffer[512];
+    size_t newline;
+    while ((newline = pending.find('\n')) == string::npos) {
+        if (pending.size() > MAX_REQUEST_SIZE) return false;
+        ssize_t n = read(sock, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        pending.append(buffer, n);
+    }
+    line = pending.substr(0, newline);
+    pending.erase(0, newline + 1);
+    return true;
 }
 
-auto now() {
-    return chrono::steady_clock::now();
+void write_reply(int client, const string& reply) {
+    string message = reply + "\n";
+    if (write(client, message.data(), message.size()) < 0 && debug_mode) {
+        cerr << COLOR_YELLOW << "[DEBUG] Client went away: " << strerror(errno) << COLOR_RESET << endl;
+    }
 }
 
-bool has_option(int argc, char* argv[], const char* option) {
-    for (int i = 0; i < argc; i++) {
-        if (strcmp(argv[i], option) == 0) return true;
+// A click job in flight on the daemon
+struct DaemonJob {
+    int client;       // Gets DONE once every stream has finished
+    size_t streams;   // Streams still running
+    int device;       // Pool device the job runs on
+    string line;      // The request, for `list`
+};
+
+// What the daemon's control thread asks of a pool device
+struct DeviceCommand {
+    enum Kind { ADD, CANCEL, RETIME, STOP } kind = STOP;
+    uint64_t tag = 0;
+    int64_t start = 0;  // ADD: schedule origin
+    ClickJob job;       // ADD: the stream; RETIME: the new hold and speed, -1 keeps one
+};
+
+// Owns one pool device with its own scheduler, timerfd and thread. The
+// control thread reaches it only through two SPSC queues and eventfds,
+// so devices click concurrently and never share a lock or a cache line
+// on the hot path. Every stream handed over comes back as exactly one
+// finished tag.
+class DeviceWorker {
+public:
+    DeviceWorker(int device_fd, int index, int done_fd)
+        : device_fd(device_fd), index(index), done_fd(done_fd) {
+        // The destructor does not run for a constructor that throws
+        auto fail = [this](const char* what) {
+            string reason = string(what) + ": " + strerror(errno);
+            close_descriptors();
+            throw runtime_error(reason);
+        };
+        wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (wake_fd < 0 || timer_fd < 0 || epoll_fd < 0) fail("Failed to set up device worker");
+        for (int fd : {wake_fd, timer_fd}) {
+            epoll_event event = {};
+            event.events = EPOLLIN;
+            event.data.fd = fd;
+            // A descriptor left out would leave the worker deaf for good
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) fail("Failed to set up device worker");
+        }
+        try {
+            worker = spawn_helper_thread([this] { run(); });
+        } catch (...) {
+            close_descriptors();
+            throw;
+        }
     }
-    return false;
+
+    ~DeviceWorker() {
+        send({});  // STOP: releases held buttons, then the thread exits
+        worker.join();
+        close_descriptors();
+    }
+
+    // The queue only fills if the worker is stalled; wait for it rather
+    // than lose a command. The worker never blocks on its own queue, so
+    // this always drains.
+    void send(const DeviceCommand& command) {
+        while (!commands.push(command)) sched_yield();
+        wake();
+    }
+
+    void wake() {
+        uint64_t one = 1;
+        write(wake_fd, &one, sizeof(one));
+    }
+
+    bool take_finished(uint64_t& tag) { return done.pop(tag); }
+
+    // Finished tags are waiting for room in the done queue; the control
+    // thread wakes the worker once it has made some
+    bool has_backlog() const { return backlog.load(); }
+
+    int device_fd;
+    size_t running_jobs = 0;  // Control thread only, for placing new jobs
+
+private:
+    void run() {
+        apply_scheduling_profile(index);
+        epoll_event events[2];
+        atomic<uint64_t>& wakeups = local_counters().wakeups;
+        for (bool running = true; running;) {
+            if (epoll_wait(epoll_fd, events, 2, -1) < 0 && errno != EINTR) {
+                cerr << COLOR_RED << "[ERROR] Device " << index << ": epoll_wait failed: " << strerror(errno)
+                     << COLOR_RESET << endl;
+                break;
+            }
+            count_add(wakeups);
+            uint64_t value;
+            while (read(timer_fd, &value, sizeof(value)) > 0) {}
+            while (read(wake_fd, &value, sizeof(value)) > 0) {}
+
+            DeviceCommand command;
+            while (commands.pop(command)) running = execute(command) && running;
+            if (running) dispatch_scheduled(scheduler, device_fd, timer_fd, &finished);
+            publish();
+        }
+        scheduler.release_all(device_fd);
+    }
+
+    // Returns false for STOP
+    bool execute(const DeviceCommand& command) {
+        switch (command.kind) {
+        case DeviceCommand::ADD:
+            // Bursts never sleep, so they run inline
+            if (command.job.burst > 0) {
+                run_job(device_fd, command.job);
+                finished.push_back(command.tag);
+            } else if (!scheduler.add(command.job, command.start, command.tag)) {
+                finished.push_back(command.tag);
+            }
+            return true;
+        case DeviceCommand::CANCEL:
+            scheduler.cancel(command.tag, &finished);
+            return true;
+        case DeviceCommand::RETIME:
+            scheduler.retime(command.tag, command.job.hold_ns, command.job.click_speed_ns);
+            return true;
+        case DeviceCommand::STOP:
+            return false;
+        }
+        return true;
+    }
+
+    void close_descriptors() {
+        for (int fd : {epoll_fd, timer_fd, wake_fd}) {
+            if (fd >= 0) close(fd);
+        }
+    }
+
+    // Pushes what fits and keeps the rest for the next pass. Waiting here
+    // for room could deadlock against a control thread waiting in send().
+    void publish() {
+        if (finished.empty()) return;
+        size_t sent = 0;
+        while (sent < finished.size() && done.push(finished[sent])) sent++;
+        finished.erase(finished.begin(), finished.begin() + sent);
+        backlog.store(!finished.empty());
+        uint64_t one = 1;
+        write(done_fd, &one, sizeof(one));
+    }
+
+    int index;
+    int done_fd;  // Shared by all workers, watched by the control thread
+    int wake_fd = -1;
+    int timer_fd = -1;
+    int epoll_fd = -1;
+    ClickScheduler scheduler;
+    vector<uint64_t> finished;  // Not yet in the done queue
+    atomic<bool> backlog{false};
+    SpscQueue<DeviceCommand, DEVICE_QUEUE_SIZE> commands;
+    SpscQueue<uint64_t, DEVICE_QUEUE_SIZE> done;
+    thread worker;
+};
+
+// Single-threaded control plane: the listening socket, every client, the
+// workers' shared completion eventfd and a signalfd all sit in one epoll
+// set. Clicking happens on one DeviceWorker per pool device, so commands
+// are served while jobs run instead of after them.
+class Daemon {
+public:
+    Daemon(const vector<int>& device_fds, int server) : server(server) {
+        done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (done_fd < 0) throw runtime_error(string("Failed to create eventfd: ") + strerror(errno));
+        for (size_t i = 0; i < device_fds.size(); i++) {
+            workers.push_back(make_unique<DeviceWorker>(device_fds[i], i, done_fd));
+        }
+    }
+
+    ~Daemon() {
+        workers.clear();  // Joins every worker after it released its buttons
+        for (const auto& connection : connections) close(connection.first);
+        if (done_fd >= 0) close(done_fd);
+        if (signal_fd >= 0) close(signal_fd);
+        if (epoll_fd >= 0) close(epoll_fd);
+    }
+
+    void run() {
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (epoll_fd < 0 || signal_fd < 0) {
+            throw runtime_error(string("Failed to set up the event loop: ") + strerror(errno));
+        }
+        watch(server);
+        watch(done_fd);
+        watch(signal_fd);
+
+        epoll_event events[32];
+        atomic<uint64_t>& iterations = local_counters().loop_iterations;
+        while (!shutting_down) {
+            int ready = epoll_wait(epoll_fd, events, 32, -1);
+            if (ready < 0) {
+                if (errno == EINTR) continue;
+                throw runtime_error(string("epoll_wait failed: ") + strerror(errno));
+            }
+            count_add(iterations);
+
+            for (int i = 0; i < ready; i++) {
+                int source = events[i].data.fd;
+                if (source == done_fd) {
+                    uint64_t count;
+                    while (read(done_fd, &count, sizeof(count)) > 0) {}
+                } else if (source == signal_fd) {
+                    shutting_down = true;
+                } else if (source == server) {
+                    accept_clients();
+                } else {
+                    serve_client(source, events[i].events);
+                }
+            }
+            report_finished();
+        }
+    }
+
+private:
+    void watch(int fd) {
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            throw runtime_error(string("Failed to watch descriptor: ") + strerror(errno));
+        }
+    }
+
+    void accept_clients() {
+        int client;
+        while ((client = accept4(server, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0) {
+            connections[client];
+            watch(client);
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            cerr << COLOR_RED << "[ERROR] Failed to accept: " << strerror(errno) << COLOR_RESET << endl;
+        }
+    }
+
+    void serve_client(int client, uint32_t ready) {
+        string& pending = connections[client];
+        char buffer[512];
+        bool open = !(ready & (EPOLLERR | EPOLLHUP));
+        for (;;) {
+            ssize_t n = read(client, buffer, sizeof(buffer));
+            if (n > 0) {
+                pending.append(buffer, n);
+                continue;
+            }
+            if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) open = false;
+            if (n < 0 && errno == EINTR) continue;
+            break;
+        }
+
+        size_t newline;
+        while (open && (newline = pending.find('\n')) != string::npos) {
+            string line = pending.substr(0, newline);
+            pending.erase(0, newline + 1);
+            open = handle_command(client, line);
+        }
+        if (open && pending.size() > MAX_REQUEST_SIZE) {
+            write_reply(client, "ERROR Malformed request");
+            open = false;
+        }
+        if (!open) drop_client(client);
+    }
+
+    // Returns false when the connection should be closed
+    bool handle_command(int client, const string& line) {
+        vector<char> buffer(line.begin(), line.end());
+        buffer.push_back('\0');
+        vector<char*> args = split_request(buffer.data());
+        if (args.size() < 2) {
+            write_reply(client, "ERROR Empty request");
+            return true;
+        }
+        const string command = args[1];
+
+        try {
+            if (command == "stats") {
+                write_stats(client);
+                return false;
+            }
+            if (command == "list") {
+                for (const auto& job : jobs) write_reply(client, to_string(job.first) + ' ' + job.second.line);
+                write_reply(client, "OK");
+                return true;
+            }
+            if (command == "cancel" || command == "rate") {
+                if (args.size() < 3) throw invalid_argument("Missing job id");
+                uint64_t id = parse_int(args[2], 1, INT32_MAX);
+                auto job = jobs.find(id);
+                if (job == jobs.end()) throw invalid_argument("Unknown job " + to_string(id));
+                DeviceCommand update;
+                update.kind = command == "cancel" ? DeviceCommand::CANCEL : DeviceCommand::RETIME;
+                update.tag = id;
+                if (command == "rate") {
+                    // Parsed like a click, so -h and -cs mean the same thing here
+                    args.erase(args.begin() + 1, args.begin() + 3);
+                    args.insert(args.begin() + 1, (char*)"l");
+                    update.job = parse_click_args(args.size(), args.data()).streams[0];
+                    bool sets_hold = false, sets_speed = false;
+                    for (size_t i = 2; i < args.size(); i++) note_timing_option(args[i], sets_hold, sets_speed);
+                    if (!sets_hold) update.job.hold_ns = -1;
+                    if (!sets_speed) update.job.click_speed_ns = -1;
+                }
+                workers[job->second.device]->send(update);
+                if (debug_mode) cout << COLOR_YELLOW << "[DEBUG] " << line << COLOR_RESET << endl;
+                write_reply(client, "OK");
+                return true;
+            }
+
+            ClickRequest request = parse_click_args(args.size(), args.data());
+            if (request.hotkey >= 0 || request.toggle || !request.shm_name.empty()) {
+                throw invalid_argument("--hotkey, --toggle and --shm run locally, not on the daemon");
+            }
+            if (request.device >= (int)workers.size()) {
+                throw invalid_argument("No device " + to_string(request.device) + ", the pool has " +
+                                       to_string(workers.size()));
+            }
+            int device = request.device >= 0 ? request.device : least_busy_device();
+            uint64_t id = next_job_id++;
+            if (debug_mode) {
+                cout << COLOR_YELLOW << "[DEBUG] Job " << id << " on device " << device << ": " << line
+                     << COLOR_RESET << endl;
+            }
+            write_reply(client, "OK " + to_string(id));
+
+            jobs[id] = {client, request.streams.size(), device, line};
+            workers[device]->running_jobs++;
+            DeviceCommand add;
+            add.kind = DeviceCommand::ADD;
+            add.tag = id;
+            add.start = monotonic_ns();
+            for (const ClickJob& job : request.streams) {
+                add.job = job;
+                workers[device]->send(add);
+            }
+        } catch (const exception& e) {
+            write_reply(client, string("ERROR ") + e.what());
+        }
+        return true;
+    }
+
+    int least_busy_device() const {
+        size_t best = 0;
+        for (size_t i = 1; i < workers.size(); i++) {
+            if (workers[i]->running_jobs < workers[best]->running_jobs) best = i;
+        }
+        return best;
+    }
+
+    // Jobs die with the connection that submitted them, like Ctrl-C on a
+    // local run
+    void drop_client(int client) {
+        for (auto& job : jobs) {
+            if (job.second.client != client) continue;
+            DeviceCommand cancel;
+            cancel.kind = DeviceCommand::CANCEL;
+            cancel.tag = job.first;
+            workers[job.second.device]->send(cancel);
+            job.second.client = -1;
+        }
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client, nullptr);
+        connections.erase(client);
+        close(client);
+    }
+
+    void report_finished() {
+        uint64_t id;
+        for (auto& worker : workers) {
+            while (worker->take_finished(id)) {
+                auto job = jobs.find(id);
+                if (job == jobs.end() || --job->second.streams > 0) continue;
+                if (job->second.client >= 0) write_reply(job->second.client, "DONE " + to_string(id));
+                worker->running_jobs--;
+                jobs.erase(job);
+            }
+            if (worker->has_backlog()) worker->wake();
+        }
+    }
+
+    int server;
+    int done_fd = -1;
+    int epoll_fd = -1;
+    int signal_fd = -1;
+    bool shutting_down = false;  // SIGINT or SIGTERM arrived on signal_fd
+    vector<unique_ptr<DeviceWorker>> workers;
+    map<uint64_t, DaemonJob> jobs;
+    map<int, string> connections;  // Client fd -> unparsed input
+    uint64_t next_job_id = 1;
+};
+
+// Keeps a pool of uinput devices alive and serves click jobs from a Unix
+// socket, so callers skip device creation and the udev hotplug on every
+// click. The devices are created in parallel, since each one waits for
+// libinput on its own.
+int run_daemon(const char* socket_path, int pool_size) {
+    int server = bind_control_socket(socket_path);
+    fcntl(server, F_SETFL, fcntl(server, F_GETFL) | O_NONBLOCK);
+
+    // Whatever was created is destroyed again if another device fails
+    const int64_t created_at = monotonic_ns();
+    vector<unique_ptr<UinputDevice>> devices(pool_size);
+    vector<exception_ptr> failures(pool_size);
+    vector<thread> creators;
+    for (int i = 0; i < pool_size; i++) {
+        creators.emplace_back([&devices, &failures, i] {
+            try {
+                devices[i].reset(new UinputDevice(i));
+            } catch (...) {
+                failures[i] = current_exception();
+            }
+        });
+    }
+    for (auto& creator : creators) creator.join();
+    for (const auto& failure : failures) {
+        if (failure) {
+            close(server);
+            unlink(socket_path);
+            rethrow_exception(failure);
+        }
+    }
+    vector<int> device_fds;
+    for (const auto& device : devices) device_fds.push_back(device->fd);
+    if (debug_mode) {
+        cout << COLOR_YELLOW << "[DEBUG] " << pool_size << (pool_size == 1 ? " device" : " devices")
+             << " ready in " << (monotonic_ns() - created_at) / NS_PER_MS << "ms" << COLOR_RESET << endl;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    cout << COLOR_BLUE << "[INFO] Listening on " << socket_path << COLOR_RESET << endl;
+
+    int status = EXIT_SUCCESS;
+    try {
+        Daemon daemon(device_fds, server);
+        daemon.run();
+    } catch (const exception& e) {
+        cerr << COLOR_RED << "[ERROR] " << e.what() << COLOR_RESET << endl;
+        status = EXIT_FAILURE;
+    }
+
+    close(server);
+    unlink(socket_path);
+    return status;
 }
 
-int get_count(int argc, char* argv[]) {
-    for (int i = 0; i < argc; i++) {
+// Forwards the arguments to a running daemon. Click jobs wait for their
+// DONE line, `list` prints the running jobs.
+int run_client(const char* socket_path, int argc, char* argv[]) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        cerr << COLOR_RED << "[ERROR] Failed to connect to " << socket_path << ": " << strerror(errno)
+             << endl << COLOR_GREEN << "[HELP] Start it with: mclick --daemon"
+             << COLOR_RESET << endl;
+        if (sock >= 0) close(sock);
+        return EXIT_FAILURE;
+    }
+
+    string request;
+    for (int i = 1; i < argc; i++) {
         string arg = argv[i];
-        if (isdigit(arg[0])) return stoi(arg);
+        if ((arg == "-s" || arg == "--socket") && i + 1 < argc) {
+            ++i;
+            continue;
+        }
+        if (!request.empty()) request += ' ';
+        request += arg;
+    }
+    request += '\n';
+
+    if (request == "stats\n") {
+        // Prometheus text until the daemon closes the connection
+        char buffer[4096];
+        ssize_t n = write(sock, request.data(), request.size());
+        while (n > 0 && (n = read(sock, buffer, sizeof(buffer))) > 0) cout.write(buffer, n);
+        close(sock);
+        return n < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    const string command = argv[1];
+    const bool is_job = command != "list" && command != "cancel" && command != "rate";
+    if (write(sock, request.data(), request.size()) != (ssize_t)request.size()) {
+        cerr << COLOR_RED << "[ERROR] Daemon closed the connection" << COLOR_RESET << endl;
+        close(sock);
+        return EXIT_FAILURE;
+    }
+
+    string pending, reply;
+    while (read_line(sock, pending, reply)) {
+        if (reply.compare(0, 6, "ERROR ") == 0) {
+            cerr << COLOR_RED << "[ERROR] " << reply.substr(6) << COLOR_RESET << endl;
+            close(sock);
+            return EXIT_FAILURE;
+        }
+        if (reply.compare(0, 5, "DONE ") == 0 || (reply.compare(0, 2, "OK") == 0 && !is_job)) {
+            close(sock);
+            return EXIT_SUCCESS;
+        }
+        if (reply.compare(0, 3, "OK ") == 0) {
+            if (debug_mode) {
+                cout << COLOR_YELLOW << "[DEBUG] Job " << reply.substr(3) << " queued" << COLOR_RESET << endl;
+            }
+            continue;
+        }
+        cout << reply << '\n';  // A `list` entry
     }
-    return DEFAULT_CLICK_COUNT;
+
+    cerr << COLOR_RED << "[ERROR] Daemon closed the connection" << COLOR_RESET << endl;
+    close(sock);
+    return EXIT_FAILURE;
 }
 
-// Forward declarations
-int parse_duration(const char* duration_str);
-int get_duration(int argc, char* argv[], const string& option);
+struct BenchResult {
+    bool high_frequency;
+    int64_t hold_ns;
+    int64_t click_speed_ns;
+    size_t clicks;
+    double target_cps;
+    double achieved_cps;
+    int64_t p50_ns, p90_ns, p99_ns, max_ns;  // Lateness against the schedule
+    int64_t drift_ns;  // First-to-last press span minus the scheduled span
+};
 
-int get_duration(int argc, char* argv[], const string& option) {
-    for (int i = 0; i < argc; i++) {
-        if (option == argv[i] && i + 1 < argc) {
-            return parse_duration(argv[i + 1]);
+int64_t percentile(const vector<int64_t>& sorted, int pct) {
+    if (sorted.empty()) return 0;
+    return sorted[min(sorted.size() - 1, sorted.size() * pct / 100)];
+}
+
+BenchResult run_bench_cell(int fd, int64_t hold_ns, int64_t click_speed_ns, int64_t duration_ns,
+                           bool high_frequency) {
+    vector<TimingSample> samples;
+    samples.reserve(2 * (duration_ns / (hold_ns + click_speed_ns)) + 4);
+
+    click_trace = &samples;
+    ClickJob job;
+    job.hold_ns = hold_ns;
+    job.click_speed_ns = click_speed_ns;
+    job.duration_ns = duration_ns;
+    job.high_frequency = high_frequency;
+    run_job(fd, job);
+    click_trace = nullptr;
+
+    BenchResult result = {};
+    result.high_frequency = high_frequency;
+    result.hold_ns = hold_ns;
+    result.click_speed_ns = click_speed_ns;
+    result.target_cps = double(NS_PER_SEC) / (hold_ns + click_speed_ns);
+
+    vector<int64_t> lateness;
+    const TimingSample* first = nullptr;
+    const TimingSample* last = nullptr;
+    for (const auto& sample : samples) {
+        lateness.push_back(sample.actual_ns - sample.deadline_ns);
+        if (sample.value != 1) continue;
+        if (!first) first = &sample;
+        last = &sample;
+        result.clicks++;
+    }
+    sort(lateness.begin(), lateness.end());
+
+    result.p50_ns = percentile(lateness, 50);
+    result.p90_ns = percentile(lateness, 90);
+    result.p99_ns = percentile(lateness, 99);
+    result.max_ns = lateness.empty() ? 0 : lateness.back();
+    if (first && last != first) {
+        int64_t span = last->actual_ns - first->actual_ns;
+        result.achieved_cps = double(result.clicks - 1) * NS_PER_SEC / span;
+        result.drift_ns = span - (last->deadline_ns - first->deadline_ns);
+    }
+    return result;
+}
+
+void print_bench_results(const vector<BenchResult>& results, const string& format) {
+    if (format == "csv") {
+        cout << "mode,hold_ns,speed_ns,clicks,target_cps,achieved_cps,p50_ns,p90_ns,p99_ns,max_ns,drift_ns\n";
+        for (const auto& r : results) {
+            cout << (r.high_frequency ? "hf" : "sleep") << ',' << r.hold_ns << ',' << r.click_speed_ns
+                 << ',' << r.clicks << ',' << r.target_cps << ',' << r.achieved_cps << ',' << r.p50_ns
+                 << ',' << r.p90_ns << ',' << r.p99_ns << ',' << r.max_ns << ',' << r.drift_ns << '\n';
+        }
+    } else if (format == "json") {
+        cout << "[\n";
+        for (size_t i = 0; i < results.size(); i++) {
+            const auto& r = results[i];
+            cout << "  {\"mode\": \"" << (r.high_frequency ? "hf" : "sleep") << "\", \"hold_ns\": " << r.hold_ns
+                 << ", \"speed_ns\": " << r.click_speed_ns << ", \"clicks\": " << r.clicks
+                 << ", \"target_cps\": " << r.target_cps << ", \"achieved_cps\": " << r.achieved_cps
+                 << ", \"p50_ns\": " << r.p50_ns << ", \"p90_ns\": " << r.p90_ns << ", \"p99_ns\": " << r.p99_ns
+                 << ", \"max_ns\": " << r.max_ns << ", \"drift_ns\": " << r.drift_ns << "}"
+                 << (i + 1 < results.size() ? "," : "") << '\n';
+        }
+        cout << "]\n";
+    } else {
+        cout << left << setw(7) << "mode" << setw(8) << "hold" << setw(8) << "speed" << right
+             << setw(8) << "clicks" << setw(11) << "target" << setw(11) << "achieved"
+             << setw(9) << "p50(us)" << setw(9) << "p90(us)" << setw(9) << "p99(us)"
+             << setw(9) << "max(us)" << setw(11) << "drift(us)" << '\n';
+        cout << fixed;
+        for (const auto& r : results) {
+            cout << left << setw(7) << (r.high_frequency ? "hf" : "sleep") << setw(8) << format_duration(r.hold_ns)
+                 << setw(8) << format_duration(r.click_speed_ns) << right << setw(8) << r.clicks
+                 << setprecision(1) << setw(11) << r.target_cps << setw(11) << r.achieved_cps
+                 << setw(9) << r.p50_ns / 1000.0 << setw(9) << r.p90_ns / 1000.0
+                 << setw(9) << r.p99_ns / 1000.0 << setw(9) << r.max_ns / 1000.0
+                 << setw(11) << r.drift_ns / 1000.0 << '\n';
         }
     }
-    return 0;
 }
 
-int parse_duration(const char* duration_str) {
-    try {
-        string s = duration_str;
-        size_t suffix_pos = s.find_first_not_of("0123456789");
-        
-        int value = stoi(s);
-        if (value <= 0) throw invalid_argument("Duration must be positive");
-        
-        // Handle 's' suffix for seconds
-        if (suffix_pos != string::npos && s[suffix_pos] == 's') {
-            return value * 1000; // Convert to milliseconds
+// Runs timed click schedules over a hold/speed grid in both scheduler
+// modes and reports lateness percentiles, achieved CPS and drift. Writes
+// go to /dev/null unless --uinput is given, so benchmarking never clicks
+// on the desktop by accident.
+int run_bench(int argc, char* argv[]) {
+    vector<int64_t> holds = {500 * NS_PER_US, 5 * NS_PER_MS, 50 * NS_PER_MS};
+    vector<int64_t> speeds = holds;
+    vector<bool> modes = {false, true};
+    int64_t duration_ns = NS_PER_SEC;
+    string format = "text";
+    bool use_uinput = false;
+
+    for (int i = 2; i < argc; ++i) {
+        string arg = argv[i];
+        if ((arg == "-h" || arg == "--hold") && i + 1 < argc) {
+            holds = {parse_duration(argv[++i])};
+        } else if ((arg == "-cs" || arg == "--clickspeed") && i + 1 < argc) {
+            speeds = {parse_duration(argv[++i])};
+        } else if ((arg == "-t" || arg == "--time") && i + 1 < argc) {
+            duration_ns = parse_duration(argv[++i]);
+        } else if (arg == "-hf" || arg == "--high-frequency") {
+            if (efficient_mode) throw invalid_argument("-hf spins, which --efficient never does");
+            modes = {true};
+        } else if (arg == "--csv" || arg == "--json") {
+            format = arg.substr(2);
+        } else if (arg == "--uinput") {
+            use_uinput = true;
+        } else if (global_option_arity(arg) >= 0) {
+            i += global_option_arity(arg); // Consumed by main
+        } else {
+            throw invalid_argument("Unknown benchmark option: " + arg);
+        }
+    }
+
+    if (efficient_mode) modes = {false};  // Only the sleeping cells, nothing spins
+    install_stop_handler();
+    // Only write timing is measured, whether anyone reads the clicks or not
+    unique_ptr<UinputDevice> device(use_uinput ? new UinputDevice(0, false) : nullptr);
+    int fd = device ? device->fd : open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (fd < 0) throw runtime_error(string("Failed to open /dev/null: ") + strerror(errno));
+    apply_scheduling_profile();
+
+    vector<BenchResult> results;
+    for (bool high_frequency : modes) {
+        for (int64_t hold_ns : holds) {
+            for (int64_t click_speed_ns : speeds) {
+                if (format == "text") {
+                    cerr << COLOR_BLUE << "[INFO] " << (high_frequency ? "hf" : "sleep") << " hold="
+                         << format_duration(hold_ns) << " speed=" << format_duration(click_speed_ns)
+                         << COLOR_RESET << endl;
+                }
+                if (stopping()) break;
+                results.push_back(run_bench_cell(fd, hold_ns, click_speed_ns, duration_ns, high_frequency));
+            }
         }
-        return value;
-    } catch (...) {
-        cerr << COLOR_RED << "[ERROR] Invalid duration: " << duration_str << COLOR_RESET << endl;
-        exit(EXIT_FAILURE);
     }
+
+    if (!use_uinput) close(fd);
+    device.reset();
+    print_bench_results(results, format);
+    return EXIT_SUCCESS;
 }
 
-void perform_clicks(int fd, int button, int count, int hold_ms, int click_speed_ms) {
-    for (int i = 0; i < count; i++) {
-        // Press-hold-release with verified timing
-        send_event(fd, button, 1);
-        sleep_ms(hold_ms);
-        send_event(fd, button, 0);
-        
-        if (i < count - 1) sleep_ms(click_speed_ms);
+// One frame of --probe, all CLOCK_MONOTONIC
+struct ProbeSample {
+    int64_t write_ns;  // Just before write() on the uinput fd
+    int64_t stamp_ns;  // input_event.time from the input core (microsecond resolution)
+    int64_t read_ns;   // When read() on the event node returned the frame
+};
+
+// Reads the event node until the SYN_REPORT that ends the frame in flight
+bool read_probe_frame(int node_fd, ProbeSample& sample) {
+    struct input_event events[MAX_FRAME_EVENTS];
+    const int64_t deadline = sample.write_ns + PROBE_TIMEOUT_NS;
+    while (!stopping()) {
+        ssize_t n = read(node_fd, events, sizeof(events));
+        const int64_t now_ns = monotonic_ns();
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EINTR) {
+                throw runtime_error(string("Failed to read event node: ") + strerror(errno));
+            }
+            if (now_ns >= deadline) return false;
+            poll_or_stop(node_fd, POLLIN, (deadline - now_ns + NS_PER_MS - 1) / NS_PER_MS);
+            continue;
+        }
+        for (size_t i = 0; i < n / sizeof(struct input_event); i++) {
+            if (events[i].type != EV_SYN || events[i].code != SYN_REPORT) continue;
+            sample.stamp_ns = events[i].input_event_sec * NS_PER_SEC + events[i].input_event_usec * NS_PER_US;
+            sample.read_ns = now_ns;
+            return true;
+        }
     }
+    return false;
 }
 
-void perform_timed_clicks(int fd, int button, int duration_ms, int hold_ms, int click_speed_ms) {
+// mclick --probe: clicks on the new device, reads every frame back from
+// its /dev/input/eventN and splits the write-to-delivery latency into
+// write -> input core stamp and write -> readable in user space. The node
+// is grabbed by default so the probe clicks never reach the desktop.
+int run_probe(int argc, char* argv[]) {
+    size_t frames = 2000;
+    int64_t interval_ns = NS_PER_MS;
+    bool grab = true, csv = false;
+    for (int i = 2; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "-n" && i + 1 < argc) {
+            frames = parse_int(argv[++i], 1, INT32_MAX);
+        } else if ((arg == "-cs" || arg == "--clickspeed") && i + 1 < argc) {
+            interval_ns = parse_duration(argv[++i]);
+        } else if (arg == "--no-grab") {
+            grab = false;
+        } else if (arg == "--csv") {
+            csv = true;
+        } else if (arg == "-d" || arg == "--debug") {
+            debug_mode = true;
+        } else if (global_option_arity(arg) >= 0) {
+            i += global_option_arity(arg); // Consumed by main
+        } else {
+            throw invalid_argument("Unknown probe option: " + arg);
+        }
+    }
+    timestamp_mode = TIMESTAMP_KERNEL;  // The stamp read back must be the input core's own
+
+    install_stop_handler();
+    UinputDevice device(0, false);  // The probe is the reader it would wait for
+    const int fd = device.fd;
+    const string node = get_event_node(fd);
+    int node_fd = node.empty() ? -1 : open(node.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    int clock_id = CLOCK_MONOTONIC;
+    if (node_fd < 0 || ioctl(node_fd, EVIOCSCLOCKID, &clock_id) < 0) {
+        string reason = node.empty() ? "event node not found" : node + ": " + strerror(errno);
+        if (node_fd >= 0) close(node_fd);
+        throw runtime_error("Failed to open the probe node, " + reason);
+    }
+    if (grab && ioctl(node_fd, EVIOCGRAB, 1) < 0) {
+        cerr << COLOR_YELLOW << "[WARN] Could not grab " << node << ", probe clicks reach the desktop: "
+             << strerror(errno) << COLOR_RESET << endl;
+    }
     if (debug_mode) {
-        cout << COLOR_YELLOW << "[DEBUG] Timed clicks: " << duration_ms << "ms" 
-             << " (hold=" << hold_ms << "ms, speed=" << click_speed_ms << "ms)" 
-             << COLOR_RESET << endl;
+        cout << COLOR_YELLOW << "[DEBUG] Probing " << node << COLOR_RESET << endl;
     }
+    apply_scheduling_profile();
 
-    auto start = chrono::steady_clock::now();
-    while (chrono::duration_cast<chrono::milliseconds>(
-        chrono::steady_clock::now() - start).count() < duration_ms) {
-        
-        // Press-hold-release cycle
-        send_event(fd, button, 1);
-        sleep_ms(hold_ms);
-        send_event(fd, button, 0);
-        
-        // Wait between cycles
-        sleep_ms(click_speed_ms);
+    vector<ProbeSample> samples;
+    samples.reserve(frames);
+    size_t lost = 0;
+    int64_t next_ns = monotonic_ns();
+    for (size_t i = 0; i < frames && !stopping(); i++) {
+        sleep_until(next_ns);
+        next_ns += interval_ns;
+
+        EventFrame frame;
+        frame.add(EV_KEY, BTN_LEFT, i % 2 == 0);
+        ProbeSample sample = {monotonic_ns(), 0, 0};
+        send_frame(fd, frame);
+        if (read_probe_frame(node_fd, sample)) {
+            samples.push_back(sample);
+        } else if (!stopping()) {
+            lost++;
+        }
+    }
+    release_keys(fd, {BTN_LEFT});
+    close(node_fd);
+
+    if (csv) {
+        cout << "write_ns,stamp_ns,read_ns\n";
+        for (const auto& s : samples) cout << s.write_ns << ',' << s.stamp_ns << ',' << s.read_ns << '\n';
+        return EXIT_SUCCESS;
+    }
+
+    // Stamps have microsecond resolution and may land just before write_ns
+    vector<int64_t> to_stamp, to_read;
+    for (const auto& s : samples) {
+        to_stamp.push_back(s.stamp_ns - s.write_ns);
+        to_read.push_back(s.read_ns - s.write_ns);
+    }
+    sort(to_stamp.begin(), to_stamp.end());
+    sort(to_read.begin(), to_read.end());
+
+    cout << samples.size() << " frames via " << node << ", " << lost << " lost\n"
+         << left << setw(16) << "" << right << setw(9) << "p50(us)" << setw(9) << "p90(us)"
+         << setw(9) << "p99(us)" << setw(9) << "max(us)" << '\n' << fixed << setprecision(1);
+    for (const auto* row : {&to_stamp, &to_read}) {
+        cout << left << setw(16) << (row == &to_stamp ? "write->stamp" : "write->read") << right
+             << setw(9) << percentile(*row, 50) / 1000.0 << setw(9) << percentile(*row, 90) / 1000.0
+             << setw(9) << percentile(*row, 99) / 1000.0
+             << setw(9) << (row->empty() ? 0 : row->back()) / 1000.0 << '\n';
     }
+    return stopping() ? 128 + stop_signal : EXIT_SUCCESS;
 }
 
+// stdio rather than iostream, so --help formats nothing it does not print
 void print_help(const char* program_name) {
-    cout << "Mouse click automation\n\n"
-         << "Usage: " << program_name << " [l/r] [options]\n\n"
-         << "Click options:\n"
-         << "  -h, --hold <ms>        Hold duration (default " << DEFAULT_HOLD_MS << "ms)\n"
-         << "  -cs, --clickspeed <ms> Delay between clicks\n"
-         << "  -t, --time <ms>        Continuous click duration\n\n"
-         << "Other options:\n"
-         << "  -d, --debug            Enable verbose output\n";
+    printf("Mouse click automation\n\n"
+           "Usage: %1$s <button> [options] [<button> [options]]...\n"
+           "       buttons: l(eft) r(ight) m(iddle) s(ide) e(xtra) f(orward) b(ack)\n"
+           "       %1$s --daemon [-s <path>] [--pool <n>]\n"
+           "       %1$s --probe [-n <frames>] [-cs <t>] [--no-grab] [--csv]\n"
+           "       %1$s --stdin    (press/release/click/move/wheel/wait or job lines)\n"
+           "       %1$s stats [-s <path>]\n"
+           "       %1$s ctl <name> [-h <t>] [-cs <t>] [--cps <n>] [pause|resume|stop]\n"
+           "       %1$s play <timeline|macro> [-hf] [--backend write|uring]\n"
+           "       %1$s compile <macro> [-o <timeline>]\n"
+           "       %1$s record <evdev-node> <timeline> [-b <buttons>] [-t <time>] [--motion]\n"
+           "       %1$s --bench [-h <t>] [-cs <t>] [-t <t>] [-hf] [--csv|--json] [--uinput]\n\n"
+           "Click options:\n"
+           "  -h, --hold <ms>        Hold duration (default %2$dms)\n"
+           "  -cs, --clickspeed <ms> Delay between clicks\n"
+           "  -t, --time <ms>        Continuous click duration\n"
+           "  -hf, --high-frequency  Spin before each deadline for us precision\n"
+           "                         (implied when -h or -cs is below 2ms)\n"
+           "  --cps, --rate <n>      Clicks per second instead of -h and -cs\n"
+           "  --duty <f>             Held share of each --cps period (default 0.5)\n"
+           "  --burst <n>            n clicks back to back in as few writes as possible\n"
+           "  --move <dx,dy>         Move the pointer in each press frame\n"
+           "  --drag <dx,dy>         Move the pointer in each release frame, dragging\n"
+           "  --wheel <n>            Scroll n detents in each press frame\n"
+           "  --jitter <t>           Move every press and release by up to +-t\n"
+           "  --jitter-dist <d>      uniform, normal (default) or lognormal\n"
+           "  --hotkey <node> <key>  Click while <key> on evdev <node> is held, e.g. F8\n"
+           "  --toggle               With --hotkey, start and stop on each press\n"
+           "  --shm <name>           Expose live timings and counters in /dev/shm/<name>\n"
+           "                         Durations take ns, us, ms (default) or s suffixes\n"
+           "  Every further button starts another stream clicking in parallel,\n"
+           "  e.g. 'l -cs 50 -t 5s r -cs 300 -t 5s'\n\n"
+           "Daemon options:\n"
+           "  --daemon               Keep the device alive and serve jobs from a socket\n"
+           "  -s, --socket <path>    Control socket (default %3$s);\n"
+           "                         with a button, send the job to that daemon\n"
+           "  --pool <n>             Create n devices, each clicking on its own thread\n"
+           "  --device <i>           Run a job on pool device i (default: the least busy)\n"
+           "  stats                  Print the daemon's counters as Prometheus text\n"
+           "  list                   Show the daemon's running jobs\n"
+           "  cancel <id>            Stop a job, releasing a held button\n"
+           "  rate <id> [-h|-cs|--cps ...] Change a running job's timings\n\n"
+           "Other options:\n"
+           "  --ready-timeout <t>    Max wait for the new device to be opened (default 500ms,\n"
+           "                         0 skips the wait)\n"
+           "  --realtime             SCHED_FIFO, mlockall and 1ns timer slack for the click loop\n"
+           "  --rt-priority <n>      SCHED_FIFO priority for --realtime (default %4$d)\n"
+           "  --cpu <n>              Pin the click loop to CPU n with --realtime\n"
+           "  --efficient            Few wakeups over precision: 25ms timer slack, shared\n"
+           "                         wakeups, no spinning; reports wakeups per minute\n"
+           "  --stats                Print counters to stderr at exit (also on SIGUSR1)\n"
+           "  --timestamps <mode>    Event stamps: kernel (default, left to the kernel),\n"
+           "                         monotonic (one read per frame) or realtime\n"
+           "  -d, --debug            Enable verbose output\n",
+           program_name, DEFAULT_HOLD_MS, DEFAULT_SOCKET_PATH, DEFAULT_RT_PRIORITY);
 }
 
 int main(int argc, char* argv[]) {
-    const unordered_map<char, int> BUTTONS = {{'l', BTN_LEFT}, {'r', BTN_RIGHT}};
-
-    if (argc < 2 || string(argv[1]) == "-h" || string(argv[1]) == "--help") {
+    if (argc < 2 || strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0) {
         print_help(argv[0]);
         return EXIT_FAILURE;
     }
 
-    char button_char = argv[1][0];
-    if (BUTTONS.find(button_char) == BUTTONS.end()) {
-        cerr << COLOR_RED << "[ERROR] Invalid button: " << button_char << endl
-             << "[HELP] Use 'l' or 'r'" << COLOR_RESET << endl;
+    const char* socket_path = get_option_value(argc, argv, "--socket");
+    if (!socket_path) socket_path = get_option_value(argc, argv, "-s");
+
+    try {
+        parse_global_options(argc, argv);
+    } catch (const exception& e) {
+        cerr << COLOR_RED << "[ERROR] " << e.what() << COLOR_RESET << endl;
         return EXIT_FAILURE;
     }
-    
-    int button = BUTTONS.at(button_char);
-    int count = get_count(argc, argv);
-    int hold_ms = DEFAULT_HOLD_MS;
-    int duration_ms = 0;
 
-    for (int i = 2; i < argc; ++i) {
-        string arg = argv[i];
-        
-        if (arg == "-d" || arg == "--debug") {
+    install_stats_handler();
+    if (print_stats_at_exit) atexit([] { write_stats(STDERR_FILENO); });
+
+    const string command = argv[1];
+    if (command == "stats" || command == "list" || command == "cancel" || command == "rate") {
+        return run_client(socket_path ? socket_path : DEFAULT_SOCKET_PATH, argc, argv);
+    }
+
+    if (command == "play") {
+        if (has_option(argc, argv, "-d") || has_option(argc, argv, "--debug")) {
+            debug_mode = true;
+            start_async_log();
+        }
+        try {
+            return run_play(argc, argv);
+        } catch (const exception& e) {
+            cerr << COLOR_RED << "[ERROR] " << e.what() << COLOR_RESET << endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (command == "compile") {
+        if (has_option(argc, argv, "-d") || has_option(argc, argv, "--debug")) debug_mode = true;
+        try {
+            return run_compile(argc, argv);
+        } catch (const exception& e) {
+            cerr << COLOR_RED << "[ERROR] " << e.what() << COLOR_RESET << endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (command == "record") {
+        if (has_option(argc, argv, "-d") || has_option(argc, argv, "--debug")) debug_mode = true;
+        try {
+            return run_record(argc, argv);
+        } catch (const exception& e) {
+            cerr << COLOR_RED << "[ERROR] " << e.what() << COLOR_RESET << endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (command == "ctl") {
+        try {
+            return run_ctl(argc, argv);
+        } catch (const exception& e) {
+            cerr << COLOR_RED << "[ERROR] " << e.what() << COLOR_RESET << endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (command == "--bench") {
+        try {
+            return run_bench(argc, argv);
+        } catch (const exception& e) {
+            cerr << COLOR_RED << "[ERROR] " << e.what() << COLOR_RESET << endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (command == "--probe") {
+        try {
+            return run_probe(argc, argv);
+        } catch (const exception& e) {
+            cerr << COLOR_RED << "[ERROR] " << e.what() << COLOR_RESET << endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (command == "--stdin") {
+        if (has_option(argc, argv, "-d") || has_option(argc, argv, "--debug")) {
+            debug_mode = true;
+            start_async_log();
+        }
+        install_stop_handler();
+        try {
+            UinputDevice device;
+            apply_scheduling_profile();
+            return run_stdin(device.fd);
+        } catch (const exception& e) {
+            cerr << COLOR_RED << "[ERROR] " << e.what() << COLOR_RESET << endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (command == "--daemon") {
+        if (has_option(argc, argv, "-d") || has_option(argc, argv, "--debug")) {
             debug_mode = true;
             cout << COLOR_BLUE << "[DEBUG] Debug mode enabled" << COLOR_RESET << endl;
-        } 
-        else if ((arg == "-h" || arg == "--hold") && i + 1 < argc) {
-            hold_ms = parse_duration(argv[++i]);
+            start_async_log();
         }
-        else if ((arg == "-cs" || arg == "--clickspeed") && i + 1 < argc) {
-            click_speed_ms.store(parse_duration(argv[++i]));
+        try {
+            const char* pool = get_option_value(argc, argv, "--pool");
+            return run_daemon(socket_path ? socket_path : DEFAULT_SOCKET_PATH,
+                              pool ? parse_int(pool, 1, MAX_POOL_DEVICES) : 1);
+        } catch (const exception& e) {
+            cerr << COLOR_RED << "[ERROR] " << e.what() << COLOR_RESET << endl;
+            return EXIT_FAILURE;
         }
-        else if ((arg == "-t" || arg == "--time") && i + 1 < argc) {
-            duration_ms = get_duration(argc, argv, arg);
+    }
+
+    ClickRequest request;
+    try {
+        request = parse_click_args(argc, argv);
+    } catch (const exception& e) {
+        cerr << COLOR_RED << "[ERROR] " << e.what() << endl
+             << "[HELP] Start with a button (l, r, m, s, e, f, b), see --help" << COLOR_RESET << endl;
+        return EXIT_FAILURE;
+    }
+
+    if (request.debug) {
+        debug_mode = true;
+        cout << COLOR_BLUE << "[DEBUG] Debug mode enabled" << COLOR_RESET << endl;
+        start_async_log();
+    }
+
+    if (socket_path) {
+        return run_client(socket_path, argc, argv);
+    }
+    if (request.device >= 0) {
+        cerr << COLOR_RED << "[ERROR] --device picks a daemon pool device, use it with -s" << COLOR_RESET << endl;
+        return EXIT_FAILURE;
+    }
+
+    if (!request.shm_name.empty()) {
+        try {
+            control_block = map_control_block(request.shm_name, true);
+        } catch (const exception& e) {
+            cerr << COLOR_RED << "[ERROR] " << e.what() << COLOR_RESET << endl;
+            return EXIT_FAILURE;
         }
+        control_block->hold_ns.store(request.streams[0].hold_ns, memory_order_relaxed);
+        control_block->click_speed_ns.store(request.streams[0].click_speed_ns, memory_order_relaxed);
+        static string shm_path;
+        shm_path = control_path(request.shm_name);
+        atexit([] { shm_unlink(shm_path.c_str()); });
     }
 
-    int fd = setup_uinput_device();
-    
+    install_stop_handler();
+
+    // The closed loop steers one stream; several streams share a
+    // scheduler and keep their plain schedules
+    RateControl rate;
+    const ClickJob& first = request.streams[0];
+    const int64_t started = monotonic_ns();
     try {
-        if (duration_ms > 0) {
-            perform_timed_clicks(fd, button, duration_ms, hold_ms, click_speed_ms.load());
+        UinputDevice device;
+        apply_scheduling_profile();
+        if (control_block) control_block->started_ns.store(monotonic_ns(), memory_order_relaxed);
+        if (request.streams.size() == 1 && first.target_cps > 0) rate_control = &rate;
+
+        if (request.hotkey >= 0) {
+            run_hotkey(device.fd, request);
         } else {
-            perform_clicks(fd, button, count, hold_ms, click_speed_ms.load());
+            run_request(device.fd, request);
         }
     } catch (const exception& e) {
+        rate_control = nullptr;
         cerr << COLOR_RED << "[ERROR] " << e.what() << COLOR_RESET << endl;
-        close(fd);
         return EXIT_FAILURE;
     }
-    
-    close(fd);
+    rate_control = nullptr;
+
+    if (rate.presses >= 2) {
+        double achieved = rate.achieved_cps();
+        cout << COLOR_BLUE << "[INFO] Achieved " << fixed << setprecision(3) << achieved << " cps (target "
+             << first.target_cps << ", " << showpos << (achieved / first.target_cps - 1) * 100 << noshowpos
+             << "%, wake lead " << setprecision(1) << rate.lead_ns / 1000.0 << "us)" << COLOR_RESET << endl;
+    }
+    if (efficient_mode) {
+        const double minutes = (monotonic_ns() - started) / (60.0 * NS_PER_SEC);
+        const uint64_t wakeups = sum_counter(&ThreadCounters::wakeups);
+        cout << COLOR_BLUE << "[INFO] " << wakeups << " wakeups, " << fixed << setprecision(1)
+             << wakeups / max(minutes, 1e-9) << " per minute" << COLOR_RESET << endl;
+    }
+
+    if (stopping()) {
+        cout << COLOR_BLUE << "[INFO] Stopped, all buttons released" << COLOR_RESET << endl;
+        return 128 + stop_signal;
+    }
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
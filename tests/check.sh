@@ -0,0 +1,48 @@
+#!/bin/sh
+# Regression checks for ./mclick against tests/fake_uinput.so. Run with
+# `make check`; each check prints ok or FAIL, the exit status counts failures.
+
+cd "$(dirname "$0")/.." || exit 1
+export LD_PRELOAD="$PWD/tests/fake_uinput.so"
+export FAKE_UINPUT_LOG="${TMPDIR:-/tmp}/mclick-check.$$"
+failures=0
+
+check() {
+    name=$1
+    shift
+    if "$@" > /dev/null 2>&1; then
+        echo "ok    $name"
+    else
+        echo "FAIL  $name"
+        failures=$((failures + 1))
+    fi
+}
+
+# The "Achieved" report counts presses; --move puts REL events ahead of
+# the key edge in each frame
+check "--cps reports the achieved rate" \
+    sh -c './mclick l --cps 50 -t 300ms 2>&1 | grep -q "Achieved"'
+check "--cps with --move reports the achieved rate" \
+    sh -c './mclick l --cps 50 -t 300ms --move 1,0 2>&1 | grep -q "Achieved"'
+
+# A --stdin click without a hold takes the default 120ms, as a bare macro
+# button does: the release lands at least 100ms after the press
+check "--stdin click holds for the default" sh -c '
+    echo "click l" | ./mclick --stdin &&
+    od -An -tu8 -w24 "$FAKE_UINPUT_LOG" | awk "
+        \$3 == 4312793089 { press = \$1 * 1000000 + \$2 }
+        \$3 == 17825793 { release = \$1 * 1000000 + \$2 }
+        END { exit !(press && release - press >= 100000) }"'
+
+# A second --shm run must not take over a block whose owner is alive
+shm_name="mclick-check-$$"
+./mclick l -h 10ms -cs 10ms -t 1s --shm "$shm_name" > /dev/null 2>&1 &
+owner=$!
+sleep 0.3
+check "--shm refuses a block in use" \
+    sh -c "! ./mclick l -t 50ms --shm $shm_name"
+check "the first --shm run keeps its block" ./mclick ctl "$shm_name"
+wait $owner
+
+rm -f "$FAKE_UINPUT_LOG" "$FAKE_UINPUT_LOG".*
+exit $failures
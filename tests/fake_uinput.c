@@ -0,0 +1,88 @@
+// Stand-in for /dev/uinput, loaded with LD_PRELOAD so the checks run
+// without root or the uinput module. Opening /dev/uinput opens
+// $FAKE_UINPUT_LOG instead (then .1, .2, ... for further devices),
+// device ioctls succeed, and every frame written is stored with a
+// CLOCK_MONOTONIC stamp so scripts can read back what was clicked.
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/uinput.h>
+
+#define MAX_FDS 4096
+
+static char fake_fds[MAX_FDS];
+static int devices_opened = 0;
+
+static int real_open(const char* path, int flags, mode_t mode) {
+    int (*next)(const char*, int, ...) = dlsym(RTLD_NEXT, "open");
+    return next(path, flags, mode);
+}
+
+int open(const char* path, int flags, ...) {
+    va_list args;
+    va_start(args, flags);
+    mode_t mode = va_arg(args, int);
+    va_end(args);
+    if (strcmp(path, "/dev/uinput") != 0) return real_open(path, flags, mode);
+
+    const char* log = getenv("FAKE_UINPUT_LOG");
+    if (!log) log = "/dev/null";
+    char name[512];
+    int index = __sync_fetch_and_add(&devices_opened, 1);
+    if (index && strcmp(log, "/dev/null") != 0) {
+        snprintf(name, sizeof(name), "%s.%d", log, index);
+    } else {
+        snprintf(name, sizeof(name), "%s", log);
+    }
+    int fd = real_open(name, O_WRONLY | O_CREAT | O_TRUNC | (flags & O_NONBLOCK), 0644);
+    if (fd >= 0 && fd < MAX_FDS) fake_fds[fd] = 1;
+    return fd;
+}
+
+int open64(const char* path, int flags, ...) {
+    va_list args;
+    va_start(args, flags);
+    mode_t mode = va_arg(args, int);
+    va_end(args);
+    return open(path, flags, mode);
+}
+
+int ioctl(int fd, unsigned long request, ...) {
+    va_list args;
+    va_start(args, request);
+    void* arg = va_arg(args, void*);
+    va_end(args);
+    if (fd < 0 || fd >= MAX_FDS || !fake_fds[fd]) {
+        int (*next)(int, unsigned long, ...) = dlsym(RTLD_NEXT, "ioctl");
+        return next(fd, request, arg);
+    }
+    // UI_GET_SYSNAME: a node that never appears, so no readiness wait
+    if (_IOC_TYPE(request) == UINPUT_IOCTL_BASE && _IOC_NR(request) == 44) {
+        strncpy(arg, "input-fake", _IOC_SIZE(request));
+        return 11;
+    }
+    return 0;
+}
+
+ssize_t write(int fd, const void* data, size_t size) {
+    ssize_t (*next)(int, const void*, size_t) = dlsym(RTLD_NEXT, "write");
+    if (fd < 0 || fd >= MAX_FDS || !fake_fds[fd] || size % sizeof(struct input_event) || size > 65536) {
+        return next(fd, data, size);
+    }
+    char stamped[65536];
+    struct timespec now;
+    memcpy(stamped, data, size);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (size_t offset = 0; offset < size; offset += sizeof(struct input_event)) {
+        struct input_event* event = (struct input_event*)(stamped + offset);
+        event->time.tv_sec = now.tv_sec;
+        event->time.tv_usec = now.tv_nsec / 1000;
+    }
+    return next(fd, stamped, size);
+}